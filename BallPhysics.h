@@ -0,0 +1,189 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#ifndef _BALL_PHYSICS_H_
+#define _BALL_PHYSICS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <Eigen/Core>
+
+/**
+* \brief Forces on a ball after it leaves the table. Gravity in m/s^2 as the Gravity of the
+* trials; drag is quadratic, a = -airDrag*|v|*v, airDrag in 1/m (rho*Cd*A/2m, about 0.14
+* for a table tennis ball); restitution is the fraction of the vertical speed kept at a
+* bounce; rollingFriction is the coefficient of the deceleration on the floor (mu*g).
+**/
+struct PhysicsModel
+{
+	double gravity;
+	double airDrag;
+	double restitution;
+	double rollingFriction;
+	double stepMs;
+
+	PhysicsModel(double _gravity=9.81, double _airDrag=0, double _restitution=0, double _rollingFriction=0, double _stepMs=0.25) :
+		gravity(_gravity), airDrag(_airDrag), restitution(_restitution), rollingFriction(_rollingFriction), stepMs(_stepMs)
+	{
+	}
+};
+
+/**
+* \class TrajectoryTable
+* \brief Trajectory of a ball integrated once per trial, then looked up at any time.
+*
+* The ball rolls on the table at its start velocity until its center passes edgeZ, then
+* flies under gravity and drag, bounces on the floor (the center at floorY) losing speed
+* by the restitution, and once a bounce would rise less than minBounceMm it rolls on the
+* floor, slowed by the rolling friction, until it stops. compute() integrates this with
+* semi-implicit Euler at the fixed step of the model and stores every step, up to
+* durationMs; at() interpolates between the two nearest steps. The same inputs always
+* give the same table, whatever the frame rate the trial is displayed at. Against the
+* parabola (no drag) the first floor contact comes out half a step early, 0.125 ms at the
+* default 0.25 ms step, and short by the distance the ball travels in that time.
+* Times are in ms from the start of the trial, positions in mm, velocities in mm/ms.
+**/
+class TrajectoryTable
+{
+public:
+	TrajectoryTable() : stepMs(1), fallTime(-1), impactTime(-1), restTime(-1),
+		impact(Eigen::Vector3d::Zero()), end(Eigen::Vector3d::Zero()), bounces(0)
+	{
+	}
+
+	void compute(const PhysicsModel &model, const Eigen::Vector3d &start, const Eigen::Vector3d &velocity,
+		double edgeZ, double floorY, double durationMs, double minBounceMm=0.5)
+	{
+		stepMs = model.stepMs;
+		int steps = (int)ceil(durationMs/stepMs) + 1;
+		positions.resize(steps);
+		fallTime = impactTime = restTime = -1;
+		impact.setZero();
+		bounces = 0;
+
+		const double g = model.gravity/1000;			// mm/ms^2
+		const double drag = model.airDrag/1000;		// 1/mm
+		const double friction = model.rollingFriction*g;
+		const double minBounceSpeed = sqrt(2*g*minBounceMm);
+		enum { TABLE, AIR, FLOOR, REST } state = TABLE;
+		Eigen::Vector3d p = start, v = velocity;
+		for (int i = 0; i < steps; i++)
+		{
+			positions[i] = p;
+			double t = i*stepMs;
+			switch (state)
+			{
+			case TABLE:
+				p += v*stepMs;
+				if (p.z() >= edgeZ)
+				{
+					state = AIR;
+					fallTime = t + stepMs;
+				}
+				break;
+			case AIR:
+			{
+				Eigen::Vector3d a(0, -g, 0);
+				a -= drag*v.norm()*v;
+				v += a*stepMs;
+				Eigen::Vector3d previous = p;
+				p += v*stepMs;
+				if (p.y() > floorY)
+					break;
+				// back to the contact point within the step, then bounce from there
+				double fraction = (previous.y() - floorY)/(previous.y() - p.y());
+				Eigen::Vector3d contact = previous + (p - previous)*fraction;
+				if (impactTime < 0)
+				{
+					impactTime = t + fraction*stepMs;
+					impact = contact;
+				}
+				v.y() = -model.restitution*v.y();
+				p = contact;
+				if (v.y() < minBounceSpeed)
+				{
+					v.y() = 0;
+					p.y() = floorY;
+					state = FLOOR;
+				}
+				else
+					bounces++;
+				break;
+			}
+			case FLOOR:
+			{
+				double speed = v.norm(), slower = speed - friction*stepMs;
+				if (slower <= 0)
+				{
+					v.setZero();
+					state = REST;
+					restTime = t;
+					break;
+				}
+				v *= slower/speed;
+				p += v*stepMs;
+				break;
+			}
+			case REST:
+				break;
+			}
+		}
+		end = p;
+	}
+
+	Eigen::Vector3d at(double t) const
+	{
+		if (positions.empty())
+			return end;
+		double step = std::max(t, 0.0)/stepMs;
+		size_t i = (size_t)step;
+		if (i + 1 >= positions.size())
+			return positions.back();
+		double fraction = step - i;
+		return positions[i]*(1 - fraction) + positions[i+1]*fraction;
+	}
+
+	// -1 if it does not happen within the table
+	double getFallTime() const { return fallTime; }
+	double getImpactTime() const { return impactTime; }
+	double getRestTime() const { return restTime; }
+	// Where the ball first touches the floor, zero if it does not
+	Eigen::Vector3d getImpactPosition() const { return impact; }
+	int getBounces() const { return bounces; }
+	double getDurationMs() const { return positions.empty() ? 0 : (positions.size() - 1)*stepMs; }
+	double getStepMs() const { return stepMs; }
+
+private:
+	double stepMs;
+	std::vector<Eigen::Vector3d> positions;
+	double fallTime, impactTime, restTime;
+	Eigen::Vector3d impact, end;
+	int bounces;
+};
+
+#endif
@@ -0,0 +1,136 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#ifndef _BALL_SYSTEM_H_
+#define _BALL_SYSTEM_H_
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <Eigen/Core>
+
+/**
+* \class BallSystem
+* \brief Any number of balls that roll at constant velocity to the table edge, fall under
+* gravity and stop on the floor, kept as one array per quantity.
+*
+* A ball rolls from its start position along x and z until its z passes edgeZ, then falls
+* from its start height with acceleration gravity (m/s^2, as the Gravity of the trials)
+* while keeping its horizontal velocity, and lands when its center reaches floorY.
+* update() evaluates the closed-form trajectory of every ball at the same time, so the
+* positions depend only on the time and not on the frame rate; the arrays are processed
+* whole, which Eigen vectorizes. getSpheres() packs the result as x, y, z, radius per
+* ball, the layout ShaderPipeline::drawSpheres() uploads for one instanced draw.
+* Times are in ms, positions in mm, velocities in mm/ms.
+**/
+class BallSystem
+{
+public:
+	BallSystem() : count(0), time(0)
+	{
+	}
+
+	void clear()
+	{
+		count = 0;
+		spheres.clear();
+	}
+
+	int add(const Eigen::Vector3d &start, double velocityX, double velocityZ, double radius,
+		double edgeZ, double floorY, double gravity)
+	{
+		grow(count + 1);
+		x0[count] = start.x();
+		y0[count] = start.y();
+		z0[count] = start.z();
+		vx[count] = velocityX;
+		vz[count] = velocityZ;
+		radii[count] = radius;
+		acceleration[count] = gravity/1000;
+		if (start.z() >= edgeZ)
+			fallTime[count] = 0;
+		else if (velocityZ > 0)
+			fallTime[count] = (edgeZ - start.z())/velocityZ;
+		else
+			fallTime[count] = std::numeric_limits<double>::infinity();
+		landTime[count] = fallTime[count] + sqrt(2*std::max(start.y() - floorY, 0.0)/acceleration[count]);
+		spheres.resize(4*(count + 1));
+		return count++;
+	}
+
+	void update(double t)
+	{
+		if (!count)
+			return;
+		elapsed.head(count) = landTime.head(count).min(t);
+		falling.head(count) = (elapsed.head(count) - fallTime.head(count)).max(0.0);
+		x.head(count) = x0.head(count) + vx.head(count)*elapsed.head(count);
+		z.head(count) = z0.head(count) + vz.head(count)*elapsed.head(count);
+		y.head(count) = y0.head(count) - 0.5*acceleration.head(count)*falling.head(count).square();
+		for (int i = 0; i < count; i++)
+		{
+			spheres[4*i] = (float)x[i];
+			spheres[4*i+1] = (float)y[i];
+			spheres[4*i+2] = (float)z[i];
+			spheres[4*i+3] = (float)radii[i];
+		}
+		time = t;
+	}
+
+	int size() const { return count; }
+	Eigen::Vector3d getPosition(int ball) const { return Eigen::Vector3d(x[ball], y[ball], z[ball]); }
+	double getRadius(int ball) const { return radii[ball]; }
+	bool isFalling(int ball) const { return time > fallTime[ball] && time < landTime[ball]; }
+	bool isLanded(int ball) const { return time >= landTime[ball]; }
+	double getFallTime(int ball) const { return fallTime[ball]; }
+	double getLandTime(int ball) const { return landTime[ball]; }
+	const float *getSpheres() const { return count ? &spheres[0] : NULL; }
+
+private:
+	int count;
+	double time;
+	Eigen::ArrayXd x0, y0, z0, vx, vz, radii, acceleration, fallTime, landTime;
+	Eigen::ArrayXd x, y, z, elapsed, falling;
+	std::vector<float> spheres;
+
+	// Capacity doubles, so that adding the balls of a trial allocates a few times at most
+	void grow(int needed)
+	{
+		if (needed <= x0.size())
+			return;
+		int capacity = std::max(needed, 2*(int)x0.size());
+		Eigen::ArrayXd *columns[] = { &x0, &y0, &z0, &vx, &vz, &radii, &acceleration, &fallTime, &landTime };
+		for (int c = 0; c < 9; c++)
+			columns[c]->conservativeResize(capacity);
+		Eigen::ArrayXd *results[] = { &x, &y, &z, &elapsed, &falling };
+		for (int c = 0; c < 5; c++)
+			results[c]->resize(capacity);
+	}
+};
+
+#endif
@@ -0,0 +1,199 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _FRAME_SCHEDULER_H_
+#define _FRAME_SCHEDULER_H_
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+
+#include "GravityHardware.h"
+#include "RealtimeProfile.h"
+#include "RenderBackend.h"
+
+/**
+* \class FrameScheduler
+* \brief Paces the frame loop on the display refresh instead of spinning: the loop sleeps
+* until latchMs before the next vsync, reads input and tracker there (the late latch) and
+* draws, and the swap that follows waits for that vsync.
+*
+* vsync() is called when the swap has returned, which is taken as a vsync; the phase and
+* the period are followed with a slow phase locked loop, so a late swap only nudges them
+* and a missed refresh is counted as such. The latch must leave enough time to draw both
+* eyes, otherwise every frame misses its refresh.
+*
+* frameShown() after each swap also times the interval between frames, for the scheduling
+* report; a loop that is not paced (free running) only uses it for that.
+**/
+class FrameScheduler
+{
+public:
+	FrameScheduler(double _periodMs=1000.0/85, double _latchMs=4, bool _paced=true) :
+		periodMs(_periodMs), latchMs(_latchMs), lastVsync(-1), missedFrames(0),
+		paced(_paced), timerResolution(false), lastFrame(-1)
+	{
+	}
+
+	void vsync(double time)
+	{
+		if (lastVsync < 0 || time - lastVsync > 1000)
+		{
+			lastVsync = time;
+			return;
+		}
+		double frames = std::max(1.0, floor((time - lastVsync)/periodMs + 0.5));
+		missedFrames += (unsigned long)frames - 1;
+		double predicted = lastVsync + frames*periodMs;
+		double error = time - predicted;
+		lastVsync = predicted + 0.1*error;
+		periodMs += 0.01*error/frames;
+	}
+
+	// Latch point of the next vsync that can still be reached from now, or now if that
+	// vsync is due but its latch point has already passed
+	double getNextLatch(double now) const
+	{
+		if (lastVsync < 0)
+			return now;
+		double vsync = lastVsync + periodMs;
+		while (vsync < now)
+			vsync += periodMs;
+		return std::max(now, vsync - latchMs);
+	}
+
+	// The vsync at which the frame started now will be shown
+	double getNextVsync(double now) const
+	{
+		return getNextLatch(now) + latchMs;
+	}
+
+	// Sleeps to a millisecond before the latch point and yields the rest
+	void waitForLatch()
+	{
+		if (!timerResolution)
+		{
+			requestTimerResolution();
+			timerResolution = true;
+		}
+		double latch = getNextLatch(hardwareClock());
+		double wait = latch - hardwareClock() - 1;
+		if (wait > 0)
+			boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)(wait*1000)));
+		while (hardwareClock() < latch)
+			boost::this_thread::yield();
+	}
+
+	// Called when the swap has returned. A paced loop waits for the swap to complete, so
+	// that this is the vsync. The interval since the previous frame is also added to
+	// trialIntervals, if given.
+	void frameShown(JitterMonitor *trialIntervals=NULL)
+	{
+		if (paced)
+			glFinish();
+		double now = hardwareClock();
+		if (paced)
+			vsync(now);
+		if (lastFrame >= 0)
+		{
+			intervals.add(now - lastFrame);
+			if (trialIntervals)
+				trialIntervals->add(now - lastFrame);
+		}
+		lastFrame = now;
+	}
+
+	// Frames more than half a period late and acquisition wake ups more than 1 ms late are
+	// counted; acquisitionWakeUps is NULL without an acquisition thread
+	void writeReport(const std::string &fileName, const JitterMonitor *acquisitionWakeUps) const
+	{
+		std::ofstream report(fileName.c_str());
+		report << "thread\tcount\tmeanMs\tsdMs\tp99Ms\tmaxMs\tlate" << std::endl;
+		intervals.report(report, "render", periodMs*1.5);
+		if (acquisitionWakeUps)
+			acquisitionWakeUps->report(report, "acquisition", 1);
+		std::cerr << "Frame interval: " << intervals.getMean() << " ms mean, " << intervals.getPercentile(99) <<
+			" ms 99th percentile, " << intervals.countOver(periodMs*1.5) << " late frames" << std::endl;
+		if (paced)
+			std::cerr << "Display period: " << periodMs << " ms, " << missedFrames << " missed refreshes at a " <<
+				latchMs << " ms latch" << std::endl;
+	}
+
+	double getPeriodMs() const { return periodMs; }
+	double getLatchMs() const { return latchMs; }
+	unsigned long getMissedFrames() const { return missedFrames; }
+
+private:
+	double periodMs, latchMs;
+	double lastVsync;
+	unsigned long missedFrames;
+	bool paced, timerResolution;
+	JitterMonitor intervals;	// between swaps
+	double lastFrame;
+};
+
+// Median interval between empty frames swapped back to back, in ms: the refresh period
+// if the swap waits for the vsync, much shorter if it does not
+inline double measureRefreshPeriod(RenderBackend *backend, int frames=60)
+{
+	std::vector<double> intervals;
+	double last = -1;
+	for (int i = 0; i <= frames; i++)
+	{
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		backend->swap();
+		glFinish();
+		double now = hardwareClock();
+		if (last >= 0)
+			intervals.push_back(now - last);
+		last = now;
+	}
+	std::sort(intervals.begin(), intervals.end());
+	return intervals.empty() ? 0 : intervals[intervals.size()/2];
+}
+
+// Frame period of the display in ms: a second of empty frames is timed, and the rate the
+// display reports is used instead if the swaps do not wait for the vsync (the measured rate
+// is then off by more than 10%). Returns fallbackMs if neither is usable.
+inline double detectRefreshPeriod(RenderBackend *backend, double fallbackMs)
+{
+	double reported = backend->getRefreshRate();
+	double measured = measureRefreshPeriod(backend);
+	bool plausible = measured > 1000.0/500 && measured < 1000.0/30;
+	double periodMs = fallbackMs;
+	if (plausible && (reported <= 0 || fabs(1000/measured - reported) < 0.1*reported))
+		periodMs = measured;
+	else if (reported > 0)
+		periodMs = 1000/reported;
+	std::cerr << "Display: " << 1000/periodMs << " Hz (" << periodMs << " ms frames)" << std::endl;
+	return periodMs;
+}
+
+#endif
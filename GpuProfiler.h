@@ -0,0 +1,208 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#ifndef _GPU_PROFILER_H_
+#define _GPU_PROFILER_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "RealtimeProfile.h"
+
+// The timestamp queries come through GLEW, so the profiler works in GRAVITY_SHADERS builds
+#ifdef GRAVITY_SHADERS
+#include <GL/glew.h>
+#endif
+
+/**
+* \class GpuProfiler
+* \brief GPU time of the phases of the frames, from timestamp queries read back without waiting.
+*
+* Between beginFrame() and endFrame() the program marks with start() the beginning of each
+* measured stretch (the stimulus of an eye) and with stamp(phase) the end of each phase:
+* the time from the previous mark is charged to the phase, summed over the eyes of the frame.
+* The queries of a frame are read at a later beginFrame(), once the GPU has written the
+* last of them; the ring holds framesInFlight frames, and a frame whose results are still
+* pending when its slot comes round again is dropped rather than waited for.
+* Phases and the whole frame are collected in JitterMonitors, cleared by reset() at every
+* trial; the results of the last frames of a trial arrive in the next one.
+**/
+class GpuProfiler
+{
+public:
+	GpuProfiler() : available(false), recording(false), current(0), dropped(0), total(0.01, 50)
+	{
+	}
+
+	int addPhase(const std::string &name)
+	{
+		names.push_back(name);
+		phases.push_back(JitterMonitor(0.01, 50));
+		frame.push_back(0);
+		return (int)names.size() - 1;
+	}
+
+	bool isAvailable() const { return available; }
+	int getPhaseCount() const { return (int)names.size(); }
+	const std::string &getPhaseName(int phase) const { return names[phase]; }
+	const JitterMonitor &getPhase(int phase) const { return phases[phase]; }
+	const JitterMonitor &getTotal() const { return total; }
+	unsigned long getDroppedFrames() const { return dropped; }
+
+	void reset()
+	{
+		for (size_t i = 0; i < phases.size(); i++)
+			phases[i].reset();
+		total.reset();
+		dropped = 0;
+	}
+
+#ifdef GRAVITY_SHADERS
+	bool init()
+	{
+		if (glewInit() != GLEW_OK || !GLEW_ARB_timer_query)
+		{
+			std::cerr << "GPU profile: timer queries not supported" << std::endl;
+			return false;
+		}
+		slots.resize(framesInFlight);
+		for (int s = 0; s < framesInFlight; s++)
+		{
+			glGenQueries(maxStamps, slots[s].queries);
+			slots[s].count = 0;
+			slots[s].pending = false;
+		}
+		available = true;
+		return true;
+	}
+
+	void beginFrame()
+	{
+		if (!available)
+			return;
+		for (int s = 0; s < framesInFlight; s++)
+			collect(slots[s], false);
+		current = (current + 1) % framesInFlight;
+		collect(slots[current], true);
+		slots[current].count = 0;
+		recording = true;
+	}
+
+	void start()
+	{
+		mark(-1);
+	}
+
+	void stamp(int phase)
+	{
+		mark(phase);
+	}
+
+	void endFrame()
+	{
+		if (!recording)
+			return;
+		slots[current].pending = slots[current].count > 0;
+		recording = false;
+	}
+
+private:
+	static const int framesInFlight = 4;
+	static const int maxStamps = 32;
+
+	struct Slot
+	{
+		GLuint queries[maxStamps];
+		int phase[maxStamps];	// -1 for start()
+		int count;
+		bool pending;
+	};
+
+	void mark(int phase)
+	{
+		if (!recording || slots[current].count == maxStamps)
+			return;
+		Slot &slot = slots[current];
+		glQueryCounter(slot.queries[slot.count], GL_TIMESTAMP);
+		slot.phase[slot.count++] = phase;
+	}
+
+	// Reads a finished frame into the monitors; an unfinished one is dropped if reusing
+	void collect(Slot &slot, bool reusing)
+	{
+		if (!slot.pending)
+			return;
+		GLint ready = 0;
+		glGetQueryObjectiv(slot.queries[slot.count-1], GL_QUERY_RESULT_AVAILABLE, &ready);
+		if (!ready)
+		{
+			if (reusing)
+			{
+				slot.pending = false;
+				dropped++;
+			}
+			return;
+		}
+		std::fill(frame.begin(), frame.end(), 0.0);
+		GLuint64 previous = 0, time = 0;
+		for (int i = 0; i < slot.count; i++)
+		{
+			glGetQueryObjectui64v(slot.queries[i], GL_QUERY_RESULT, &time);
+			if (slot.phase[i] >= 0 && i > 0)
+				frame[slot.phase[i]] += (time - previous)*1e-6;
+			previous = time;
+		}
+		double frameMs = 0;
+		for (size_t p = 0; p < phases.size(); p++)
+		{
+			phases[p].add(frame[p]);
+			frameMs += frame[p];
+		}
+		total.add(frameMs);
+		slot.pending = false;
+	}
+
+	std::vector<Slot> slots;
+#else
+	bool init() { return false; }
+	void beginFrame() {}
+	void start() {}
+	void stamp(int) {}
+	void endFrame() {}
+
+private:
+#endif
+	bool available, recording;
+	int current;
+	unsigned long dropped;
+	std::vector<std::string> names;
+	std::vector<JitterMonitor> phases;
+	std::vector<double> frame;	// phase times of the frame being collected
+	JitterMonitor total;
+};
+
+#endif
@@ -0,0 +1,578 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _GRAVITY_HARDWARE_H_
+#define _GRAVITY_HARDWARE_H_
+
+#include <cstdio>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "Marker.h"
+#include "Optotrak2.h"
+#include "BrownMotorFunctions.h"
+#include "GravityRandom.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <MMSystem.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Coordinate the Optotrak reports for a marker it cannot see
+#define OCCLUDED_COORDINATE (-3.697314E28)
+
+// Creates a directory; nothing happens if it already exists
+inline void makeDirectory(const std::string &name)
+{
+#ifdef _WIN32
+	_mkdir(name.c_str());
+#else
+	mkdir(name.c_str(), 0755);
+#endif
+}
+
+// Milliseconds since the first call, the common clock of the simulated devices
+inline double hardwareClock()
+{
+	static const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()/1000.0;
+}
+
+/******************************** TRACKER ********************************/
+/**
+* \class Tracker
+* \brief Source of the marker positions read by updateTheMarkers().
+**/
+class Tracker
+{
+public:
+	virtual ~Tracker() {}
+	// Starts the acquisition, false if the device could not be started
+	virtual bool init() = 0;
+	// Fetches the latest frame
+	virtual void update() = 0;
+	virtual void stop() {}
+
+	const std::vector<Marker> &getAllMarkers() const { return markers; }
+	// Time of the current frame in ms, on the clock of the tracker
+	double getSampleTime() const { return sampleTime; }
+
+protected:
+	Tracker() : sampleTime(0) {}
+	std::vector<Marker> markers;
+	double sampleTime;
+};
+
+/**
+* \class OptotrakTracker
+* \brief The Optotrak of the rig.
+**/
+class OptotrakTracker : public Tracker
+{
+public:
+	OptotrakTracker(const std::string &_alignedFile, int _numMarkers, double _frameRate, double _markerFreq,
+		double _dutyCycle, double _voltage, const Eigen::Vector3d &_translation) :
+		alignedFile(_alignedFile), numMarkers(_numMarkers), frameRate(_frameRate), markerFreq(_markerFreq),
+		dutyCycle(_dutyCycle), voltage(_voltage), translation(_translation)
+	{
+	}
+
+	bool init()
+	{
+		optotrak.setTranslation(translation);
+		return optotrak.init(alignedFile, numMarkers, frameRate, markerFreq, dutyCycle, voltage) == 0;
+	}
+
+	void update()
+	{
+		optotrak.updateMarkers();
+		markers = optotrak.getAllMarkers();
+		sampleTime = hardwareClock();
+	}
+
+	void stop()
+	{
+		optotrak.stopCollection();
+	}
+
+private:
+	Optotrak2 optotrak;
+	std::string alignedFile;
+	int numMarkers;
+	double frameRate, markerFreq, dutyCycle, voltage;
+	Eigen::Vector3d translation;
+};
+
+/**
+* \class MarkerStreamWriter
+* \brief Records the frames of a tracker, one line per frame: the time in ms followed by
+* x y z of every marker, tab separated. Occluded markers keep the Optotrak's coordinate.
+**/
+class MarkerStreamWriter
+{
+public:
+	bool open(const std::string &fileName)
+	{
+		file.open(fileName.c_str());
+		file << std::setprecision(10);
+		return file.is_open();
+	}
+
+	void write(double time, const std::vector<Marker> &markers)
+	{
+		if (!file.is_open())
+			return;
+		file << time;
+		for (size_t i = 0; i < markers.size(); i++)
+			file << "\t" << markers[i].p.x() << "\t" << markers[i].p.y() << "\t" << markers[i].p.z();
+		file << "\n";
+	}
+
+private:
+	std::ofstream file;
+};
+
+/**
+* \class RecordedTracker
+* \brief Simulated tracker playing back a stream written by MarkerStreamWriter.
+*
+* In realtime mode update() returns the frame recorded at the time elapsed since init(),
+* so the program sees the same frame rate and the same gaps as on the rig; at max speed
+* every update() returns the next frame. The stream restarts when it ends. Without a
+* stream, every one of numMarkers markers stays occluded.
+* Sample times are on hardwareClock(), as the live tracker's: in realtime mode a frame is
+* stamped at init() plus its offset in the recording (plus one recording per restart), so
+* the times keep their recorded spacing and never go back; at max speed a frame is
+* stamped when update() returns it.
+**/
+class RecordedTracker : public Tracker
+{
+public:
+	RecordedTracker(const std::string &_fileName, int _numMarkers, bool _realtime=true) :
+		fileName(_fileName), numMarkers(_numMarkers), realtime(_realtime), current(0), startTime(0)
+	{
+	}
+
+	bool init()
+	{
+		Marker occluded;
+		occluded.p = Eigen::Vector3d::Constant(OCCLUDED_COORDINATE);
+		markers.assign(numMarkers, occluded);
+		frames.clear();
+		times.clear();
+
+		if (!fileName.empty())
+		{
+			std::ifstream file(fileName.c_str());
+			if (!file.is_open())
+			{
+				std::cerr << fileName << " not found" << std::endl;
+				return false;
+			}
+			std::string line;
+			while (std::getline(file, line))
+			{
+				std::istringstream values(line);
+				double time;
+				if (!(values >> time))
+					continue;
+				std::vector<Marker> frame(numMarkers, occluded);
+				for (int i = 0; i < numMarkers; i++)
+					if (!(values >> frame[i].p.x() >> frame[i].p.y() >> frame[i].p.z()))
+						break;
+				times.push_back(time);
+				frames.push_back(frame);
+			}
+			std::cerr << "Playing back " << frames.size() << " frames of " << fileName << (realtime ? " in real time" : " at max speed") << std::endl;
+		}
+		// at max speed the first update() moves to frame 0
+		current = (realtime || frames.empty()) ? 0 : frames.size()-1;
+		startTime = hardwareClock();
+		return true;
+	}
+
+	void update()
+	{
+		if (frames.empty())
+		{
+			sampleTime = hardwareClock();
+			return;
+		}
+		if (realtime)
+		{
+			double duration = times.back() - times.front();
+			double playback = hardwareClock() - startTime;
+			double loopStart = 0;
+			if (duration > 0)
+			{
+				loopStart = floor(playback/duration)*duration;
+				playback -= loopStart;
+			}
+			// frames are in time order, carry on from the last one returned
+			if (times[current] - times.front() > playback)
+				current = 0;
+			while (current+1 < frames.size() && times[current+1] - times.front() <= playback)
+				current++;
+			sampleTime = startTime + loopStart + times[current] - times.front();
+		}
+		else
+		{
+			current = (current+1) % frames.size();
+			sampleTime = hardwareClock();
+		}
+		markers = frames[current];
+	}
+
+private:
+	std::string fileName;
+	int numMarkers;
+	bool realtime;
+	std::vector< std::vector<Marker> > frames;
+	std::vector<double> times;
+	size_t current;
+	double startTime;
+};
+
+/**
+* \brief Settings of a SyntheticTracker: the markers, the frame rate, the noise, the
+* occlusions and the rigid bodies (lists of marker indices) that move together.
+**/
+struct SyntheticMarkerConfig
+{
+	SyntheticMarkerConfig() : numMarkers(0), rateHz(100), noiseSD(0), occlusionsPerSecond(0), occlusionMs(0), seed(1) {}
+	int numMarkers;
+	double rateHz;
+	double noiseSD;
+	double occlusionsPerSecond;
+	double occlusionMs;
+	unsigned int seed;
+	std::vector< std::vector<int> > bodies;
+};
+
+/**
+* \class SyntheticTracker
+* \brief Simulated tracker generating marker frames on its own thread, like the Optotrak
+* collects them in background, for load tests of the tracking pipeline.
+*
+* Every rigid body in config.bodies moves its markers together along a smooth reaching
+* path (each body with its own phase); the other markers stay still. Frames come at
+* config.rateHz (several kHz are fine, short periods are busy-waited), each coordinate
+* gets gaussian noise of config.noiseSD mm, and every marker starts an occlusion of
+* config.occlusionMs with a probability of config.occlusionsPerSecond per second.
+* All random draws come from the RNG_TRACKER stream indexed by frame and marker, so a
+* configuration always produces the same stream. update() returns the newest frame,
+* getFrameNumber() tells which one it was so frames skipped by the reader can be counted.
+**/
+class SyntheticTracker : public Tracker
+{
+public:
+	SyntheticTracker(const SyntheticMarkerConfig &_config) :
+		config(_config), random(_config.seed, RNG_TRACKER), running(false), latestTime(0), latestFrame(0), frameNumber(0)
+	{
+	}
+
+	~SyntheticTracker()
+	{
+		stop();
+	}
+
+	bool init()
+	{
+		if (config.numMarkers <= 0 || config.rateHz <= 0)
+			return false;
+		for (size_t b = 0; b < config.bodies.size(); b++)
+			for (size_t k = 0; k < config.bodies[b].size(); k++)
+				if (config.bodies[b][k] < 0 || config.bodies[b][k] >= config.numMarkers)
+					return false;
+
+		bodyOf.assign(config.numMarkers, -1);
+		slotOf.assign(config.numMarkers, 0);
+		for (size_t b = 0; b < config.bodies.size(); b++)
+			for (size_t k = 0; k < config.bodies[b].size(); k++)
+			{
+				bodyOf[config.bodies[b][k]] = (int)b;
+				slotOf[config.bodies[b][k]] = (int)k;
+			}
+		occludedUntil.assign(config.numMarkers, -1.0);
+		latest.resize(config.numMarkers);
+		generate(0, 0.0, latest);
+		markers = latest;
+
+		running = true;
+		startTime = hardwareClock();
+		thread = boost::thread(&SyntheticTracker::run, this);
+		return true;
+	}
+
+	void update()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		markers = latest;
+		sampleTime = latestTime;
+		frameNumber = latestFrame;
+	}
+
+	void stop()
+	{
+		if (!running)
+			return;
+		running = false;
+		thread.join();
+	}
+
+	// Frame returned by the last update(), counted from 0
+	boost::uint64_t getFrameNumber() const { return frameNumber; }
+
+private:
+	SyntheticMarkerConfig config;
+	RandomStream random;
+	std::vector<int> bodyOf, slotOf;
+	std::vector<double> occludedUntil;	// only touched by the generator thread
+	std::vector<Marker> latest;
+	double startTime;
+	volatile bool running;
+	double latestTime;
+	boost::uint64_t latestFrame, frameNumber;
+	boost::mutex mutex;
+	boost::thread thread;
+
+	void run()
+	{
+		double period = 1000.0/config.rateHz;
+		std::vector<Marker> frame(config.numMarkers);
+		for (boost::uint64_t n = 1; running; n++)
+		{
+			double due = startTime + n*period;
+			double wait = due - hardwareClock();
+			if (wait > 2)
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)((wait-1)*1000)));
+			while (hardwareClock() < due)
+				boost::this_thread::yield();
+
+			double time = hardwareClock();
+			generate(n, time - startTime, frame);
+			boost::mutex::scoped_lock lock(mutex);
+			latest.swap(frame);
+			latestTime = time;
+			latestFrame = n;
+		}
+	}
+
+	// Frame n at t ms from the start
+	void generate(boost::uint64_t n, double t, std::vector<Marker> &frame)
+	{
+		static const double PI = 3.14159265358979;
+		const double framesPerSecond = config.rateHz;
+		for (int i = 0; i < config.numMarkers; i++)
+		{
+			Eigen::Vector3d p;
+			if (bodyOf[i] >= 0)
+			{
+				// reach of 150 mm in depth at 0.5 Hz, bodies side by side
+				double phase = 2*PI*(0.5*t/1000.0) + bodyOf[i];
+				Eigen::Vector3d center(100.0*bodyOf[i], 20*sin(2*phase), -300 - 75*(1-cos(phase)));
+				p = center + Eigen::Vector3d(15.0*(slotOf[i]%2), 15.0*(slotOf[i]/2%2), 15.0*(slotOf[i]/4));
+			}
+			else
+				p = Eigen::Vector3d(-200 + 10.0*i, -100, -500);
+
+			boost::uint64_t index = (n*config.numMarkers + i)*8;
+			if (config.noiseSD > 0)
+			{
+				// Box-Muller, three coordinates from two pairs
+				for (int c = 0; c < 3; c++)
+				{
+					double u1 = 1.0 - random.uniformAt(index + 2*c), u2 = random.uniformAt(index + 2*c + 1);
+					p[c] += config.noiseSD*sqrt(-2*log(u1))*cos(2*PI*u2);
+				}
+			}
+			if (config.occlusionsPerSecond > 0 && t >= occludedUntil[i] &&
+				random.uniformAt(index + 6) < config.occlusionsPerSecond/framesPerSecond)
+				occludedUntil[i] = t + config.occlusionMs;
+			if (t < occludedUntil[i])
+				p = Eigen::Vector3d::Constant(OCCLUDED_COORDINATE);
+			frame[i].p = p;
+		}
+	}
+};
+
+/******************************** MOTORS *********************************/
+/**
+* \class Motors
+* \brief The motors used by the experiments, with the signatures of BrownMotorFunctions.
+**/
+class Motors
+{
+public:
+	virtual ~Motors() {}
+	virtual void homeEverything(int armSpeed, int screenSpeed) = 0;
+	virtual void moveScreenAbsolute(double focalDistance, double homeFocalDistance, int screenSpeed) = 0;
+	virtual void moveScreenAbsoluteAsynchronous(double focalDistance, double homeFocalDistance, int screenSpeed) = 0;
+};
+
+class BrownMotors : public Motors
+{
+public:
+	void homeEverything(int armSpeed, int screenSpeed)
+	{
+		BrownMotorFunctions::homeEverything(armSpeed, screenSpeed);
+	}
+
+	void moveScreenAbsolute(double focalDistance, double homeFocalDistance, int screenSpeed)
+	{
+		BrownMotorFunctions::moveScreenAbsolute(focalDistance, homeFocalDistance, screenSpeed);
+	}
+
+	void moveScreenAbsoluteAsynchronous(double focalDistance, double homeFocalDistance, int screenSpeed)
+	{
+		BrownMotorFunctions::moveScreenAbsoluteAsynchronous(focalDistance, homeFocalDistance, screenSpeed);
+	}
+};
+
+/**
+* \class SimulatedMotors
+* \brief Keeps track of the screen position; the synchronous calls block for moveDelayMs
+* so that the program keeps the pauses it has on the rig.
+**/
+class SimulatedMotors : public Motors
+{
+public:
+	SimulatedMotors(int _moveDelayMs=0) : moveDelayMs(_moveDelayMs), screenPosition(0) {}
+
+	void homeEverything(int armSpeed, int screenSpeed)
+	{
+		screenPosition = 0;
+		wait();
+	}
+
+	void moveScreenAbsolute(double focalDistance, double homeFocalDistance, int screenSpeed)
+	{
+		screenPosition = focalDistance - homeFocalDistance;
+		wait();
+	}
+
+	void moveScreenAbsoluteAsynchronous(double focalDistance, double homeFocalDistance, int screenSpeed)
+	{
+		screenPosition = focalDistance - homeFocalDistance;
+	}
+
+	// Screen displacement from home in mm
+	double getScreenPosition() const { return screenPosition; }
+
+private:
+	int moveDelayMs;
+	double screenPosition;
+
+	void wait()
+	{
+		if (moveDelayMs > 0)
+			boost::this_thread::sleep(boost::posix_time::milliseconds(moveDelayMs));
+	}
+};
+
+/******************************** AUDIO **********************************/
+// Sound file of every beepOk() tone, NULL where no sound is assigned
+inline const char *toneFileName(int tone)
+{
+	// Remember to put double slash \\ to specify directories!!!
+	static const char *files[] = {
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-1.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\calibrate.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-reject.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-twoBlips.wav",
+		NULL,
+		NULL,
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-left.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-right.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-home.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-grasp.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-marker.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-estimate.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8_lowpass.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8_double.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-rising.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-falling.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-highBubblePop.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-lowBubblePop.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-success.wav",
+		"C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-watch.wav"
+	};
+	if (tone < 0 || tone >= (int)(sizeof(files)/sizeof(files[0])))
+		return NULL;
+	return files[tone];
+}
+
+/**
+* \class Audio
+* \brief Plays the feedback tones of beepOk(), asynchronously.
+**/
+class Audio
+{
+public:
+	virtual ~Audio() {}
+	virtual void play(int tone) = 0;
+};
+
+#ifdef _WIN32
+class WindowsAudio : public Audio
+{
+public:
+	void play(int tone)
+	{
+		const char *fileName = toneFileName(tone);
+		if (fileName)
+			PlaySound((LPCSTR)fileName, NULL, SND_FILENAME | SND_ASYNC);
+	}
+};
+#endif
+
+/**
+* \class SimulatedAudio
+* \brief Logs the tones with their time instead of playing them.
+**/
+class SimulatedAudio : public Audio
+{
+public:
+	void play(int tone)
+	{
+		std::cerr << std::fixed << std::setprecision(1) << hardwareClock() << " ms: tone " << tone << std::endl;
+	}
+};
+
+#endif
@@ -0,0 +1,124 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _GRAVITY_PARAMETERS_H_
+#define _GRAVITY_PARAMETERS_H_
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+* Reads every "Key: value" line of a parameters file into a map, using the same
+* conventions as ParametersLoader (comments start with #). Used for the optional
+* keys that older parameters files do not have, since those have a default value.
+**/
+inline std::map<std::string, std::string> readParameterLines(const std::string &fileName)
+{
+	std::map<std::string, std::string> lines;
+	std::ifstream file(fileName.c_str());
+	std::string line;
+	while (std::getline(file, line))
+	{
+		size_t comment = line.find('#');
+		if (comment != std::string::npos)
+			line = line.substr(0, comment);
+		size_t colon = line.find(':');
+		if (colon == std::string::npos)
+			continue;
+
+		std::string key, value;
+		std::istringstream keyStream(line.substr(0, colon));
+		keyStream >> key;
+		if (key.empty())
+			continue;
+		value = line.substr(colon+1);
+		size_t first = value.find_first_not_of(" \t\r");
+		size_t last = value.find_last_not_of(" \t\r");
+		lines[key] = (first == std::string::npos) ? std::string() : value.substr(first, last-first+1);
+	}
+	return lines;
+}
+
+// Returns the value of an optional key, or the default when the key is missing or empty
+inline std::string findParameter(const std::map<std::string, std::string> &lines, const std::string &key, const std::string &defaultValue)
+{
+	std::map<std::string, std::string>::const_iterator iter = lines.find(key);
+	if (iter == lines.end() || iter->second.empty())
+		return defaultValue;
+	return iter->second;
+}
+
+inline std::string findParameter(const std::map<std::string, std::string> &lines, const std::string &key, const char *defaultValue)
+{
+	return findParameter(lines, key, std::string(defaultValue));
+}
+
+template <typename Scalar>
+Scalar findParameter(const std::map<std::string, std::string> &lines, const std::string &key, Scalar defaultValue)
+{
+	std::map<std::string, std::string>::const_iterator iter = lines.find(key);
+	if (iter == lines.end() || iter->second.empty())
+		return defaultValue;
+	std::istringstream value(iter->second);
+	Scalar result = defaultValue;
+	value >> result;
+	return result;
+}
+
+// Splits a list of numbers separated by spaces or commas, as in "2,1.5,0.5,0.2"
+template <typename Scalar>
+std::vector<Scalar> parameterList(const std::string &value)
+{
+	std::string spaced = value;
+	for (size_t i = 0; i < spaced.size(); i++)
+		if (spaced[i] == ',')
+			spaced[i] = ' ';
+	std::istringstream stream(spaced);
+	std::vector<Scalar> values;
+	Scalar x;
+	while (stream >> x)
+		values.push_back(x);
+	return values;
+}
+
+// Factor levels, the keys starting with "f" without the prefix, as TrialGenerator names them
+inline std::map<std::string, std::vector<double> > parameterFactors(const std::map<std::string, std::string> &lines)
+{
+	std::map<std::string, std::vector<double> > factors;
+	for (std::map<std::string, std::string>::const_iterator iter = lines.begin(); iter != lines.end(); ++iter)
+	{
+		if (iter->first.size() > 1 && iter->first[0] == 'f')
+		{
+			std::vector<double> levels = parameterList<double>(iter->second);
+			if (!levels.empty())
+				factors[iter->first.substr(1)] = levels;
+		}
+	}
+	return factors;
+}
+
+#endif
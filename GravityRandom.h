@@ -0,0 +1,100 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _GRAVITY_RANDOM_H_
+#define _GRAVITY_RANDOM_H_
+
+#include <boost/cstdint.hpp>
+
+// Stream identifiers, one per subsystem that needs random numbers
+enum RandomStreamId
+{
+	RNG_SCHEDULE = 1,	// trial order (seeds rand() for TrialGenerator/BalanceFactor)
+	RNG_PROBE = 2,		// probe placement
+	RNG_MASKS = 3,		// noise masks
+	RNG_OBSERVER = 4,	// simulated observers
+	RNG_TRACKER = 5,	// synthetic marker streams
+	RNG_BALLS = 6		// speeds of the extra balls
+};
+
+/**
+* \class RandomStream
+* \brief Counter-based random number stream.
+*
+* The n-th number of a stream is a pure function of (seed, stream id, n): the stream key
+* is added to n times the golden ratio constant and passed through the SplitMix64
+* finalizer. Streams with different ids never share state, the whole state of a stream
+* is its counter, and numbers can be drawn by index (uniformAt(), uniformIntAt()), so a
+* trial or a mask tile always gets the same number no matter in which order, or on
+* which thread, it is generated.
+**/
+class RandomStream
+{
+public:
+	RandomStream(boost::uint64_t seed=0, boost::uint64_t stream=0) :
+		key(mix(seed ^ mix(stream*0x9E3779B97F4A7C15ULL))), counter(0)
+	{
+	}
+
+	// Raw 64 bit number at the given index, does not advance the stream
+	boost::uint64_t at(boost::uint64_t index) const
+	{
+		return mix(key + (index+1)*0x9E3779B97F4A7C15ULL);
+	}
+
+	// Uniform number in [0,1) at the given index
+	double uniformAt(boost::uint64_t index) const
+	{
+		return (at(index) >> 11)*(1.0/9007199254740992.0);
+	}
+
+	// Uniform integer in [0,n) at the given index
+	int uniformIntAt(boost::uint64_t index, int n) const
+	{
+		return (int)(uniformAt(index)*n);
+	}
+
+	// Sequential draws
+	boost::uint64_t next() { return at(counter++); }
+	double uniform() { return uniformAt(counter++); }
+	double uniform(double a, double b) { return a + (b-a)*uniform(); }
+	int uniformInt(int n) { return uniformIntAt(counter++, n); }
+	double operator()() { return uniform(); }
+
+	boost::uint64_t getCounter() const { return counter; }
+	void setCounter(boost::uint64_t _counter) { counter = _counter; }
+
+private:
+	boost::uint64_t key;
+	boost::uint64_t counter;
+
+	static boost::uint64_t mix(boost::uint64_t z)
+	{
+		z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+};
+
+#endif
@@ -0,0 +1,284 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _HEAD_TRACKING_H_
+#define _HEAD_TRACKING_H_
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "GravityHardware.h"
+#include "RigidBodySolver.h"
+#include "MotionPredictor.h"
+#include "RealtimeProfile.h"
+
+/**
+* \class AcquisitionThread
+* \brief Reads the tracker on its own thread and tracks the eyes from the head markers.
+*
+* The thread updates the tracker as fast as it delivers frames (sleeping pollMs between
+* reads), publishes every frame for updateTheMarkers() and, once calibrated, solves the
+* two eyes as rigid bodies on the three head markers and feeds each to a MotionPredictor.
+* The render thread then asks for the eyes extrapolated to photon time, so the head
+* latency is one prediction lead, independent of when the frame loop polls the markers.
+* calibrate() attaches the given eye positions to the head as it is now: the subject
+* sits in the reference position and the static eyes become the calibration.
+* With setRealtime() the thread pins itself to a core at the highest priority, and it
+* always keeps how late it wakes up from each poll in getWakeUpJitter().
+* Sample times are those of the tracker, on hardwareClock() for every Tracker, so they
+* compare with the photon times of the frame loop.
+**/
+class AcquisitionThread
+{
+public:
+	AcquisitionThread(Tracker *_tracker, int head1, int head2, int head3, double _pollMs=0.5) :
+		tracker(_tracker), pollMs(_pollMs), running(false), realtime(false), core(-1), sampleTime(0),
+		frameCount(0), calibrated(false), measuredCyclopean(Eigen::Vector3d::Zero()), measuredTime(-1)
+	{
+		headMarkers[0] = head1;
+		headMarkers[1] = head2;
+		headMarkers[2] = head3;
+		leftEye = solver.addBody(head1, head2, head3);
+		rightEye = solver.addBody(head1, head2, head3);
+	}
+
+	~AcquisitionThread()
+	{
+		stop();
+	}
+
+	void start()
+	{
+		if (running)
+			return;
+		running = true;
+		thread = boost::thread(&AcquisitionThread::run, this);
+	}
+
+	void stop()
+	{
+		if (!running)
+			return;
+		running = false;
+		thread.join();
+	}
+
+	bool isRunning() const { return running; }
+
+	// Takes effect at start()
+	void setRealtime(int _core)
+	{
+		realtime = true;
+		core = _core;
+	}
+
+	// Delay past pollMs of each wake up, read it after stop()
+	const JitterMonitor &getWakeUpJitter() const { return wakeUps; }
+
+	// Latest frame and the time it was sampled; returns the number of frames read so far
+	unsigned long getMarkers(std::vector<Marker> &_markers, double &_sampleTime)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		_markers = markers;
+		_sampleTime = sampleTime;
+		return frameCount;
+	}
+
+	// Attaches the eyes, given in tracker coordinates, to the head markers of the last frame.
+	// Fails, keeping the previous calibration, if a head marker is not visible.
+	bool calibrate(const Eigen::Vector3d &left, const Eigen::Vector3d &right)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		for (int i = 0; i < 3; i++)
+			if (headMarkers[i] >= (int)markers.size() || !RigidBodySolver::isVisible(markers[headMarkers[i]].p))
+				return false;
+		solver.init(leftEye, left, markers);
+		solver.init(rightEye, right, markers);
+		leftPredictor.reset();
+		rightPredictor.reset();
+		measuredTime = -1;
+		calibrated = true;
+		return true;
+	}
+
+	bool isCalibrated()
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		return calibrated;
+	}
+
+	// Eyes extrapolated to photonTime, false (and the eyes untouched) while the head is lost
+	bool getEyes(double photonTime, Eigen::Vector3d &left, Eigen::Vector3d &right, double &headSampleTime)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if (!calibrated || !leftPredictor.isTracking(photonTime) || !rightPredictor.isTracking(photonTime))
+			return false;
+		left = leftPredictor.predict(photonTime);
+		right = rightPredictor.predict(photonTime);
+		headSampleTime = leftPredictor.getLastMeasurementTime();
+		return true;
+	}
+
+	// Cyclopean eye as measured on the last frame with the head visible, and its time
+	bool getLastMeasurement(Eigen::Vector3d &cyclopean, double &time)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if (!calibrated || measuredTime < 0)
+			return false;
+		cyclopean = measuredCyclopean;
+		time = measuredTime;
+		return true;
+	}
+
+private:
+	Tracker *tracker;
+	double pollMs;
+	volatile bool running;
+	boost::thread thread;
+	boost::mutex mutex;
+	bool realtime;
+	int core;
+	JitterMonitor wakeUps;
+
+	std::vector<Marker> markers;
+	double sampleTime;
+	unsigned long frameCount;
+
+	RigidBodySolver solver;
+	int leftEye, rightEye;
+	int headMarkers[3];
+	bool calibrated;
+	MotionPredictor leftPredictor, rightPredictor;
+	Eigen::Vector3d measuredCyclopean;
+	double measuredTime;
+
+	void run()
+	{
+		if (realtime && !makeCurrentThreadRealtime(core))
+			std::cerr << "Acquisition thread: real-time scheduling not (fully) available" << std::endl;
+		double lastSample = -1;
+		while (running)
+		{
+			tracker->update();
+			double time = tracker->getSampleTime();
+			if (time != lastSample)
+			{
+				lastSample = time;
+				boost::mutex::scoped_lock lock(mutex);
+				markers = tracker->getAllMarkers();
+				sampleTime = time;
+				frameCount++;
+				if (calibrated)
+				{
+					solver.solve(markers);
+					if (solver.isBodyVisible(leftEye))
+					{
+						leftPredictor.correct(solver.getPoint(leftEye), time);
+						rightPredictor.correct(solver.getPoint(rightEye), time);
+						measuredCyclopean = (solver.getPoint(leftEye) + solver.getPoint(rightEye))/2;
+						measuredTime = time;
+					}
+				}
+			}
+			double sleepStart = hardwareClock();
+			if (pollMs > 0)
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)(pollMs*1000)));
+			else
+				boost::this_thread::yield();
+			wakeUps.add(hardwareClock() - sleepStart - pollMs);
+		}
+	}
+};
+
+/**
+* \class HeadTrackedEyes
+* \brief The frame loop side of head tracking: the eyes of every frame from an
+* AcquisitionThread, and the latency and prediction error of the trial, written as one
+* line of the _head.txt file.
+**/
+class HeadTrackedEyes
+{
+public:
+	HeadTrackedEyes() : lastSample(-1)
+	{
+	}
+
+	// Eyes extrapolated to photonTime. The eyes are left as they are while the head is lost,
+	// so the static eyes stay until the acquisition is calibrated.
+	void update(AcquisitionThread &acquisition, double photonTime, Eigen::Vector3d &eyeLeft, Eigen::Vector3d &eyeRight)
+	{
+		Eigen::Vector3d measured;
+		double measuredTime;
+		bool newSample = acquisition.getLastMeasurement(measured, measuredTime) && measuredTime != lastSample;
+		if (newSample)
+		{
+			lastSample = measuredTime;
+			metrics.sample(measured, measuredTime);
+		}
+
+		Eigen::Vector3d left, right;
+		double headSampleTime = 0;
+		bool tracking = acquisition.getEyes(photonTime, left, right, headSampleTime);
+		if (tracking)
+		{
+			eyeLeft = left;
+			eyeRight = right;
+		}
+		metrics.frame(photonTime, headSampleTime, (left+right)/2, newSample, tracking);
+	}
+
+	// At the start of every trial
+	void resetMetrics()
+	{
+		metrics.reset();
+	}
+
+	void writeTrial(std::ostream &out, const std::string &subjectName, int trialNumber, bool headTracking) const
+	{
+		out << std::fixed <<
+			subjectName << "\t" <<
+			trialNumber << "\t" <<
+			headTracking << "\t" <<
+			metrics.frames << "\t" <<
+			metrics.measured << "\t" <<
+			metrics.bridged << "\t" <<
+			metrics.lost << "\t" <<
+			metrics.getMeanLag() << "\t" <<
+			metrics.getMaxLag() << "\t" <<
+			metrics.getErrorRMS() << "\t" <<
+			metrics.getMaxError() << std::endl;
+	}
+
+private:
+	PredictionMetrics metrics;
+	double lastSample;
+};
+
+#endif
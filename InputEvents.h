@@ -0,0 +1,442 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _INPUT_EVENTS_H_
+#define _INPUT_EVENTS_H_
+
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "GravityHardware.h"
+
+/**
+* \brief A key press (or release) and the time it happened, in ms on hardwareClock()
+**/
+struct InputEvent
+{
+	unsigned char key;
+	double time;
+	bool pressed;
+};
+
+/**
+* \class InputQueue
+* \brief Thread safe queue of input events, filled by the input sources and emptied by the
+* frame loop, so that handling a response never waits for a frame and vice versa.
+**/
+class InputQueue
+{
+public:
+	void push(unsigned char key, double time, bool pressed=true)
+	{
+		InputEvent event;
+		event.key = key;
+		event.time = time;
+		event.pressed = pressed;
+		boost::mutex::scoped_lock lock(mutex);
+		events.push_back(event);
+	}
+
+	bool pop(InputEvent &event)
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		if (events.empty())
+			return false;
+		event = events.front();
+		events.pop_front();
+		return true;
+	}
+
+private:
+	boost::mutex mutex;
+	std::deque<InputEvent> events;
+};
+
+/**
+* \class InputThread
+* \brief Samples the state of the response keys on its own thread every pollMs and queues
+* every press with the time it was seen, independently of the GLUT event loop.
+*
+* Digits and '+' are read from both the main keyboard and the numeric keypad; the main
+* keyboard '+' is the VK_OEM_PLUS key, shifted or not, as layouts differ.
+* With releases=true the releases are queued too, for the keys that act while held.
+* Windows sleeps at least a millisecond, so below pollMs=1 the thread yields instead of
+* sleeping and keeps a core busy for sub-millisecond timestamps. Needs GetAsyncKeyState,
+* so start() fails on other platforms and the program falls back to the GLUT keyboard
+* callback for every key.
+**/
+class InputThread
+{
+public:
+	InputThread(InputQueue *_queue, const std::string &_keys, double _pollMs=0.25, bool _releases=false) :
+		queue(_queue), keys(_keys), pollMs(_pollMs), releases(_releases), running(false)
+	{
+	}
+
+	~InputThread()
+	{
+		stop();
+	}
+
+	// A started thread, or NULL where key states cannot be polled (the GLUT keyboard
+	// callback then handles every key)
+	static InputThread *launch(InputQueue *queue, const std::string &keys, double pollMs=0.25, bool releases=false)
+	{
+		InputThread *input = new InputThread(queue, keys, pollMs, releases);
+		if (input->start())
+			return input;
+		delete input;
+		return NULL;
+	}
+
+	bool start()
+	{
+#ifdef _WIN32
+		if (running)
+			return true;
+		running = true;
+		thread = boost::thread(&InputThread::run, this);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void stop()
+	{
+		if (!running)
+			return;
+		running = false;
+		thread.join();
+	}
+
+	// True if key is read by this thread, the GLUT callback must then ignore it. A key
+	// without a virtual key code is never seen here and stays with the callback.
+	bool watches(unsigned char key) const
+	{
+#ifdef _WIN32
+		return running && keys.find((char)key) != std::string::npos && !virtualKeys(key).empty();
+#else
+		return false;
+#endif
+	}
+
+private:
+	InputQueue *queue;
+	std::string keys;
+	double pollMs;
+	bool releases;
+	volatile bool running;
+	boost::thread thread;
+
+#ifdef _WIN32
+	// Virtual key codes of a character, on the main keyboard and on the keypad
+	static std::vector<int> virtualKeys(unsigned char key)
+	{
+		std::vector<int> codes;
+		if (key >= '0' && key <= '9')
+		{
+			codes.push_back(key);
+			codes.push_back(VK_NUMPAD0 + (key - '0'));
+		}
+		else if (key == '+')
+		{
+			codes.push_back(VK_OEM_PLUS);
+			codes.push_back(VK_ADD);
+		}
+		else if (key == 27)
+			codes.push_back(VK_ESCAPE);
+		else if (isalpha(key))
+			codes.push_back(toupper(key));
+		return codes;
+	}
+
+	void run()
+	{
+		std::vector< std::vector<int> > codes(keys.size());
+		std::vector<bool> down(keys.size(), false);
+		for (size_t k = 0; k < keys.size(); k++)
+			codes[k] = virtualKeys(keys[k]);
+
+		while (running)
+		{
+			double time = hardwareClock();
+			for (size_t k = 0; k < keys.size(); k++)
+			{
+				bool pressed = false;
+				for (size_t c = 0; c < codes[k].size(); c++)
+					pressed = pressed || (GetAsyncKeyState(codes[k][c]) & 0x8000) != 0;
+				if (pressed && !down[k])
+					queue->push(keys[k], time);
+				else if (releases && !pressed && down[k])
+					queue->push(keys[k], time, false);
+				down[k] = pressed;
+			}
+			if (pollMs >= 1)
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)(pollMs*1000)));
+			else
+				boost::this_thread::yield();
+		}
+	}
+#endif
+};
+
+/**
+* \class HoldAdjuster
+* \brief Turns holding a key into a continuous movement: a press moves by stepMm at once,
+* after holdDelayMs the movement starts at minSpeed and accelerates up to maxSpeed (mm/s)
+* until the key is released.
+*
+* press() and release() take the times of the key events, update() the current time and
+* returns the displacement since the previous call, so the movement is integrated over
+* time and does not depend on the frame rate or on the keyboard auto-repeat. The
+* direction is +1 or -1, the last key pressed wins.
+**/
+class HoldAdjuster
+{
+public:
+	HoldAdjuster(double _stepMm=1, double _holdDelayMs=150, double _minSpeed=20, double _maxSpeed=200, double _acceleration=400) :
+		stepMm(_stepMm), holdDelayMs(_holdDelayMs), minSpeed(_minSpeed), maxSpeed(_maxSpeed),
+		acceleration(_acceleration)
+	{
+		stop();
+	}
+
+	// Returns the immediate step, repeated presses of the held key are ignored
+	double press(int _direction, double time)
+	{
+		if (direction == _direction)
+			return 0;
+		pending += travelSince(time);
+		direction = _direction;
+		pressTime = time;
+		lastTime = time;
+		return direction*stepMm;
+	}
+
+	void release(int _direction, double time)
+	{
+		if (direction != _direction)
+			return;
+		pending += travelSince(time);
+		direction = 0;
+	}
+
+	double update(double time)
+	{
+		double displacement = pending + travelSince(time);
+		pending = 0;
+		return displacement;
+	}
+
+	// Drops the held key, e.g. at the end of the range or of the trial
+	void stop()
+	{
+		direction = 0;
+		pending = 0;
+		pressTime = lastTime = 0;
+	}
+
+	bool isHeld() const
+	{
+		return direction != 0;
+	}
+
+private:
+	double stepMm, holdDelayMs, minSpeed, maxSpeed, acceleration;
+	int direction;
+	double pressTime, lastTime, pending;
+
+	// Distance covered after holding the key for holdMs
+	double travel(double holdMs) const
+	{
+		double t = (holdMs - holdDelayMs)/1000;
+		if (t <= 0)
+			return 0;
+		double accelerationTime = (maxSpeed - minSpeed)/acceleration;
+		if (t <= accelerationTime)
+			return minSpeed*t + acceleration*t*t/2;
+		return minSpeed*accelerationTime + acceleration*accelerationTime*accelerationTime/2 +
+			maxSpeed*(t - accelerationTime);
+	}
+
+	double travelSince(double time)
+	{
+		if (direction == 0 || time <= lastTime)
+			return 0;
+		double displacement = direction*(travel(time - pressTime) - travel(lastTime - pressTime));
+		lastTime = time;
+		return displacement;
+	}
+};
+
+/**
+* \class ResponseTimes
+* \brief Reaction times of a trial and input-to-feedback latency of the session, all on
+* hardwareClock() so that stimulus, key presses and feedback are on the same time base.
+*
+* key() is called with the time of each press before it is handled and keyHandled() after,
+* feedback() when a tone is played. The onset is the time of the frame that shows the
+* stimulus to respond to; getters return -1 for the events that did not happen.
+**/
+class ResponseTimes
+{
+public:
+	ResponseTimes()
+	{
+		reset();
+	}
+
+	// Called at the start of every trial, the session latencies are kept
+	void reset()
+	{
+		onset = -1;
+		firstKey = -1;
+		response = -1;
+		responseLatency = -1;
+		pendingKey = -1;
+	}
+
+	// Only the first call of a trial counts
+	void stimulusOnset(double time)
+	{
+		if (onset < 0)
+			onset = time;
+	}
+
+	void key(double time)
+	{
+		pendingKey = time;
+	}
+
+	void keyHandled()
+	{
+		pendingKey = -1;
+	}
+
+	// The key being handled changes the response, the first one after the onset is kept
+	void adjust()
+	{
+		if (firstKey < 0 && onset >= 0 && pendingKey >= onset)
+			firstKey = pendingKey;
+	}
+
+	// The key being handled is the final response of the trial
+	void respond()
+	{
+		adjust();
+		response = pendingKey;
+	}
+
+	void feedback(double time)
+	{
+		if (pendingKey < 0)
+			return;
+		double latency = time - pendingKey;
+		latencies.push_back(latency);
+		if (pendingKey == response)
+			responseLatency = latency;
+	}
+
+	double getOnset(double trialStart) const
+	{
+		return onset < 0 ? -1 : onset - trialStart;
+	}
+
+	double getFirstKeyTime() const
+	{
+		return firstKey < 0 ? -1 : firstKey - onset;
+	}
+
+	double getReactionTime() const
+	{
+		return (response < 0 || onset < 0) ? -1 : response - onset;
+	}
+
+	double getFeedbackLatency() const
+	{
+		return responseLatency;
+	}
+
+	// Session summary of the time from a key press to its feedback
+	int getLatencyCount() const
+	{
+		return (int)latencies.size();
+	}
+
+	double getMeanLatency() const
+	{
+		double sum = 0;
+		for (size_t i = 0; i < latencies.size(); i++)
+			sum += latencies[i];
+		return latencies.empty() ? 0 : sum/latencies.size();
+	}
+
+	double getLatencyPercentile(double percentile) const
+	{
+		if (latencies.empty())
+			return 0;
+		std::vector<double> sorted(latencies);
+		std::sort(sorted.begin(), sorted.end());
+		size_t i = (size_t)(percentile/100.0*(sorted.size()-1) + 0.5);
+		return sorted[std::min(i, sorted.size()-1)];
+	}
+
+	double getMaxLatency() const
+	{
+		return latencies.empty() ? 0 : *std::max_element(latencies.begin(), latencies.end());
+	}
+
+	// The session line of the _latency.txt file, and the same summary to the console
+	void writeSummary(std::ostream &out, const std::string &subjectName, unsigned int seed, int trials) const
+	{
+		out << std::fixed <<
+			subjectName << "\t" <<
+			seed << "\t" <<
+			trials << "\t" <<
+			getLatencyCount() << "\t" <<
+			getMeanLatency() << "\t" <<
+			getLatencyPercentile(50) << "\t" <<
+			getLatencyPercentile(95) << "\t" <<
+			getMaxLatency() << std::endl;
+		std::cerr << "Input to feedback latency: " << getMeanLatency() << " ms mean, " <<
+			getLatencyPercentile(95) << " ms 95th percentile over " << getLatencyCount() << " keys" << std::endl;
+	}
+
+private:
+	double onset, firstKey, response, responseLatency;
+	double pendingKey;
+	std::vector<double> latencies;
+};
+
+#endif
@@ -0,0 +1,206 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _MOTION_PREDICTOR_H_
+#define _MOTION_PREDICTOR_H_
+
+#include <cmath>
+#include <deque>
+#include <utility>
+#include <algorithm>
+
+#include <Eigen/Core>
+
+/**
+* \class MotionPredictor
+* \brief Constant-acceleration Kalman filter of a 3D point, used to extrapolate the finger
+* to the time its frame will be on screen.
+*
+* The state holds position, velocity and acceleration; the three axes share the same
+* model and are measured together, so they share one 3x3 covariance and the state is a
+* 3x3 matrix (rows position/velocity/acceleration, columns x/y/z). Acceleration changes
+* as white noise jerk of spectral density processNoise (mm^2/s^5); measurements have a
+* standard deviation of measurementNoise mm. Times are in ms.
+* predict() extrapolates without changing the state, so it bridges occlusions: it
+* answers as long as the last measurement is not older than maxOcclusionMs.
+**/
+class MotionPredictor
+{
+public:
+	MotionPredictor(double _processNoise=1E7, double _measurementNoise=0.2, double _maxOcclusionMs=100) :
+		processNoise(_processNoise), measurementNoise(_measurementNoise), maxOcclusionMs(_maxOcclusionMs)
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		initialized = false;
+		state.setZero();
+		covariance.setZero();
+		lastTime = 0;
+	}
+
+	// New measurement p taken at time t
+	void correct(const Eigen::Vector3d &p, double t)
+	{
+		if (!initialized || t - lastTime > maxOcclusionMs)
+		{
+			// (re)start at rest after a long gap, with a wide prior on velocity and acceleration
+			state.setZero();
+			state.row(0) = p.transpose();
+			covariance.setZero();
+			covariance(0,0) = measurementNoise*measurementNoise;
+			covariance(1,1) = 1E6;		// (1 m/s)^2
+			covariance(2,2) = 1E8;		// (10 m/s^2)^2
+			lastTime = t;
+			initialized = true;
+			return;
+		}
+
+		double dt = std::max(t - lastTime, 0.0)/1000.0;
+		Eigen::Matrix3d F = transition(dt);
+		state = F*state;
+		covariance = F*covariance*F.transpose() + noise(dt);
+
+		Eigen::RowVector3d innovation = p.transpose() - state.row(0);
+		double S = covariance(0,0) + measurementNoise*measurementNoise;
+		Eigen::Vector3d K = covariance.col(0)/S;
+		state += K*innovation;
+		covariance -= K*covariance.row(0);
+		lastTime = t;
+	}
+
+	// True if predict(t) can be trusted
+	bool isTracking(double t) const
+	{
+		return initialized && t - lastTime <= maxOcclusionMs;
+	}
+
+	// Position extrapolated to time t
+	Eigen::Vector3d predict(double t) const
+	{
+		double dt = (t - lastTime)/1000.0;
+		return (state.row(0) + dt*state.row(1) + 0.5*dt*dt*state.row(2)).transpose();
+	}
+
+	Eigen::Vector3d getVelocity() const { return state.row(1).transpose(); }
+	double getLastMeasurementTime() const { return lastTime; }
+
+private:
+	double processNoise, measurementNoise, maxOcclusionMs;
+	bool initialized;
+	Eigen::Matrix3d state, covariance;
+	double lastTime;
+
+	static Eigen::Matrix3d transition(double dt)
+	{
+		Eigen::Matrix3d F;
+		F << 1, dt, 0.5*dt*dt,
+			0, 1, dt,
+			0, 0, 1;
+		return F;
+	}
+
+	Eigen::Matrix3d noise(double dt) const
+	{
+		double dt2 = dt*dt, dt3 = dt2*dt;
+		Eigen::Matrix3d Q;
+		Q << dt3*dt2/20, dt2*dt2/8, dt3/6,
+			dt2*dt2/8, dt3/3, dt2/2,
+			dt3/6, dt2/2, dt;
+		return processNoise*Q;
+	}
+};
+
+/**
+* \class PredictionMetrics
+* \brief Per-trial latency and prediction error of the finger.
+*
+* Every displayed frame records its lag (display time minus time of the sample it is
+* based on) and the position predicted for the display time. When a sample taken at or
+* after that display time arrives, the prediction is compared with it. The error
+* therefore includes up to one tracker period of mismatch between the two times.
+**/
+class PredictionMetrics
+{
+public:
+	PredictionMetrics() { reset(); }
+
+	void reset()
+	{
+		frames = measured = bridged = lost = 0;
+		lagSum = lagMax = 0;
+		errorSquaredSum = errorMax = 0;
+		errors = 0;
+		pending.clear();
+	}
+
+	// A frame shown at displayTime with a sample of sampleTime, predicted at position
+	void frame(double displayTime, double sampleTime, const Eigen::Vector3d &position, bool newSample, bool tracking)
+	{
+		frames++;
+		if (!tracking)
+		{
+			lost++;
+			return;
+		}
+		if (newSample)
+			measured++;
+		else
+			bridged++;
+		double lag = displayTime - sampleTime;
+		lagSum += lag;
+		lagMax = std::max(lagMax, lag);
+		pending.push_back(std::make_pair(displayTime, position));
+	}
+
+	// A sample p taken at time t resolves the predictions made for times up to t
+	void sample(const Eigen::Vector3d &p, double t)
+	{
+		while (!pending.empty() && pending.front().first <= t)
+		{
+			double error = (pending.front().second - p).norm();
+			errorSquaredSum += error*error;
+			errorMax = std::max(errorMax, error);
+			errors++;
+			pending.pop_front();
+		}
+	}
+
+	int frames, measured, bridged, lost;
+	double getMeanLag() const { return (measured+bridged) ? lagSum/(measured+bridged) : 0; }
+	double getMaxLag() const { return lagMax; }
+	double getErrorRMS() const { return errors ? sqrt(errorSquaredSum/errors) : 0; }
+	double getMaxError() const { return errorMax; }
+
+private:
+	double lagSum, lagMax;
+	double errorSquaredSum, errorMax;
+	int errors;
+	std::deque< std::pair<double, Eigen::Vector3d> > pending;
+};
+
+#endif
@@ -0,0 +1,184 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+
+#ifndef _OCCLUSION_WINDOWS_H_
+#define _OCCLUSION_WINDOWS_H_
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BallPhysics.h"
+
+/**
+* \brief A part of the trajectory where the ball is hidden, counted from the moment it
+* leaves the table: start and length in ms (TIME), in mm travelled along the path (PATH),
+* or the near edge and depth, in mm of z past the table edge, of an occluder that hides the
+* ball while its center is behind it (OCCLUDER).
+**/
+struct OcclusionWindow
+{
+	enum Kind { TIME, PATH, OCCLUDER };
+	Kind kind;
+	double start;
+	double length;
+
+	OcclusionWindow(Kind _kind=TIME, double _start=0, double _length=0) :
+		kind(_kind), start(_start), length(_length)
+	{
+	}
+
+	// "time", "path" or "occluder"; false for anything else
+	static bool parseKind(const std::string &name, Kind &kind)
+	{
+		if (name == "time")
+			kind = TIME;
+		else if (name == "path")
+			kind = PATH;
+		else if (name == "occluder")
+			kind = OCCLUDER;
+		else
+			return false;
+		return true;
+	}
+};
+
+/**
+* \class OcclusionSchedule
+* \brief Visibility of the ball over a trial, from occlusion windows laid on its trajectory.
+*
+* build() runs once per trial on the precomputed trajectory and turns every window,
+* whatever its kind, into an interval of trial time during which the ball is hidden, so
+* visibility() is a lookup in a handful of intervals. With a fade time the ball fades out
+* over fadeMs before an interval and back in over fadeMs after it; visibility() is then
+* the alpha of the ball, 0 hidden and 1 fully visible. Times are in ms from the start of
+* the trial, as in TrajectoryTable.
+**/
+class OcclusionSchedule
+{
+public:
+	OcclusionSchedule(double _fadeMs=0) : fadeMs(_fadeMs)
+	{
+	}
+
+	void setFadeMs(double _fadeMs) { fadeMs = _fadeMs; }
+	double getFadeMs() const { return fadeMs; }
+	void clear() { intervals.clear(); }
+	int size() const { return (int)intervals.size(); }
+	double getStart(int i) const { return intervals[i].first; }
+	double getEnd(int i) const { return intervals[i].second; }
+
+	void build(const std::vector<OcclusionWindow> &windows, const TrajectoryTable &trajectory, double edgeZ)
+	{
+		intervals.clear();
+		double fallTime = trajectory.getFallTime();
+		if (fallTime < 0)
+			return;
+		double step = trajectory.getStepMs(), duration = trajectory.getDurationMs();
+		for (size_t w = 0; w < windows.size(); w++)
+		{
+			const OcclusionWindow &window = windows[w];
+			if (window.length <= 0)
+				continue;
+			switch (window.kind)
+			{
+			case OcclusionWindow::TIME:
+				add(fallTime + window.start, fallTime + window.start + window.length);
+				break;
+			case OcclusionWindow::PATH:
+			{
+				double path = 0, begin = -1;
+				Eigen::Vector3d previous = trajectory.at(fallTime);
+				for (double t = fallTime + step; t <= duration; t += step)
+				{
+					Eigen::Vector3d p = trajectory.at(t);
+					path += (p - previous).norm();
+					previous = p;
+					if (begin < 0 && path >= window.start)
+						begin = t;
+					if (path >= window.start + window.length)
+					{
+						add(begin, t);
+						begin = -1;
+						break;
+					}
+				}
+				if (begin >= 0)
+					add(begin, duration);
+				break;
+			}
+			case OcclusionWindow::OCCLUDER:
+			{
+				double nearZ = edgeZ + window.start, farZ = nearZ + window.length, begin = -1;
+				for (double t = 0; t <= duration; t += step)
+				{
+					double z = trajectory.at(t).z();
+					bool behind = z >= nearZ && z <= farZ;
+					if (behind && begin < 0)
+						begin = t;
+					else if (!behind && begin >= 0)
+					{
+						add(begin, t);
+						begin = -1;
+					}
+				}
+				if (begin >= 0)
+					add(begin, duration);
+				break;
+			}
+			}
+		}
+	}
+
+	double visibility(double t) const
+	{
+		double alpha = 1;
+		for (size_t i = 0; i < intervals.size(); i++)
+		{
+			double start = intervals[i].first, end = intervals[i].second;
+			if (t >= start && t < end)
+				return 0;
+			if (fadeMs > 0 && t < start && t >= start - fadeMs)
+				alpha = std::min(alpha, (start - t)/fadeMs);
+			else if (fadeMs > 0 && t >= end && t < end + fadeMs)
+				alpha = std::min(alpha, (t - end)/fadeMs);
+		}
+		return alpha;
+	}
+
+private:
+	double fadeMs;
+	std::vector< std::pair<double, double> > intervals;
+
+	void add(double start, double end)
+	{
+		if (end > start)
+			intervals.push_back(std::make_pair(start, end));
+	}
+};
+
+#endif
@@ -0,0 +1,333 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _PSI_STAIRCASE_H_
+#define _PSI_STAIRCASE_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+#include "GravityParameters.h"
+#include "GravityRandom.h"
+
+/**
+* \class PsiStaircase
+* \brief Bayesian adaptive procedure (Kontsevich & Tyler's Psi method) over threshold and slope.
+*
+* The observer is modelled as p(yes|x) = lapse/2 + (1-lapse)/(1+exp(-slope*(x-threshold))).
+* The posterior lives on a threshold x slope grid, the candidate stimulus levels are fixed,
+* and the likelihoods together with their logarithms are tabulated once in init(), so that
+* choosing the next level (minimum expected posterior entropy) needs no transcendental
+* functions, only levels*grid multiply-adds.
+**/
+class PsiStaircase
+{
+public:
+	PsiStaircase() : lapse(0), stepsDone(0), currentLevel(0) {}
+
+	void init(const std::vector<double> &_levels, const std::vector<double> &_thresholds, const std::vector<double> &_slopes, double _lapse)
+	{
+		levels = _levels;
+		thresholds = _thresholds;
+		slopes = _slopes;
+		lapse = _lapse;
+		stepsDone = 0;
+		history.clear();
+
+		int nParams = (int)(thresholds.size()*slopes.size());
+		int nLevels = (int)levels.size();
+		likelihood.resize(nLevels*nParams);
+		logLikelihood.resize(nLevels*nParams);
+		logComplement.resize(nLevels*nParams);
+		for (int x = 0; x < nLevels; x++)
+		{
+			for (int k = 0; k < nParams; k++)
+			{
+				// kept off 0 and 1, where a log would be infinite
+				double p = std::min(std::max(psychometric(levels[x], thresholds[k/slopes.size()], slopes[k%slopes.size()]), 1E-12), 1 - 1E-12);
+				likelihood[x*nParams+k] = p;
+				logLikelihood[x*nParams+k] = log(p);
+				logComplement[x*nParams+k] = log(1.0-p);
+			}
+		}
+
+		// uniform prior
+		posterior.assign(nParams, 1.0/nParams);
+		logPosterior.resize(nParams);
+		selectNext();
+	}
+
+	double psychometric(double x, double threshold, double slope) const
+	{
+		return 0.5*lapse + (1.0-lapse)/(1.0 + exp(-slope*(x-threshold)));
+	}
+
+	// Level to present on the next trial
+	double getState() const
+	{
+		return levels.empty() ? 0.0 : levels[currentLevel];
+	}
+
+	// Bayes update with the answer given at getState(), then chooses the next level
+	void step(bool answer)
+	{
+		int nParams = (int)posterior.size();
+		const double *L = &likelihood[currentLevel*nParams];
+		double sum = 0;
+		for (int k = 0; k < nParams; k++)
+		{
+			posterior[k] *= answer ? L[k] : 1.0-L[k];
+			sum += posterior[k];
+		}
+		for (int k = 0; k < nParams; k++)
+			posterior[k] /= sum;
+
+		history.push_back(std::make_pair(getState(), answer));
+		stepsDone++;
+		selectNext();
+	}
+
+	int getStepsDone() const { return stepsDone; }
+
+	// Posterior mean and standard deviation of the threshold
+	double getThreshold() const { return marginalMean(true); }
+	double getThresholdSD() const { return marginalSD(true); }
+	double getSlope() const { return marginalMean(false); }
+
+	const std::vector< std::pair<double,bool> > &getHistory() const { return history; }
+
+private:
+	std::vector<double> levels, thresholds, slopes;
+	double lapse;
+	std::vector<double> likelihood, logLikelihood, logComplement;
+	std::vector<double> posterior, logPosterior;
+	std::vector< std::pair<double,bool> > history;
+	int stepsDone;
+	int currentLevel;
+
+	// Expected entropy for level x, written so that only the tabulated logarithms are needed:
+	// p(yes)*H(yes) = p(yes)*log p(yes) - sum_k post_k*L_k*(log post_k + log L_k), same for "no"
+	void selectNext()
+	{
+		int nParams = (int)posterior.size();
+		int nLevels = (int)levels.size();
+		for (int k = 0; k < nParams; k++)
+			logPosterior[k] = posterior[k] > 0 ? log(posterior[k]) : 0.0;
+
+		double bestEntropy = 0;
+		for (int x = 0; x < nLevels; x++)
+		{
+			const double *L = &likelihood[x*nParams];
+			const double *logL = &logLikelihood[x*nParams];
+			const double *logC = &logComplement[x*nParams];
+			double pYes = 0, sumYes = 0, sumNo = 0;
+			for (int k = 0; k < nParams; k++)
+			{
+				double yes = posterior[k]*L[k];
+				double no = posterior[k]-yes;
+				pYes += yes;
+				sumYes += yes*(logPosterior[k]+logL[k]);
+				sumNo += no*(logPosterior[k]+logC[k]);
+			}
+			double pNo = 1.0-pYes;
+			double entropy = -sumYes - sumNo;
+			if (pYes > 0)
+				entropy += pYes*log(pYes);
+			if (pNo > 0)
+				entropy += pNo*log(pNo);
+			if (x == 0 || entropy < bestEntropy)
+			{
+				bestEntropy = entropy;
+				currentLevel = x;
+			}
+		}
+	}
+
+	double marginalMean(bool threshold) const
+	{
+		double mean = 0;
+		for (size_t k = 0; k < posterior.size(); k++)
+			mean += posterior[k]*(threshold ? thresholds[k/slopes.size()] : slopes[k%slopes.size()]);
+		return mean;
+	}
+
+	double marginalSD(bool threshold) const
+	{
+		double mean = marginalMean(threshold), variance = 0;
+		for (size_t k = 0; k < posterior.size(); k++)
+		{
+			double value = threshold ? thresholds[k/slopes.size()] : slopes[k%slopes.size()];
+			variance += posterior[k]*(value-mean)*(value-mean);
+		}
+		return sqrt(variance);
+	}
+};
+
+/**
+* \class PsiTrialGenerator
+* \brief Interleaves one PsiStaircase per combination of factor levels, mirroring the
+* getCurrent()/next()/isEmpty() interface of TrialGenerator.
+*
+* Reads from the parameters file the factors ("f" keys), the clamps of the staircase
+* (sStairClampLower, sStairClampUpper) and the following optional keys:
+*   sPsiMaxTrials  trials per condition (default 40)
+*   sPsiTargetSD   a condition stops early when the threshold SD is below this (default 0, never)
+*   sPsiLevelStep  spacing of the probeSpeed levels and of the threshold grid (default 0.5)
+*   sPsiSlopes     candidate slopes (default 0.25,0.5,1,2,4)
+*   sPsiLapse      lapse rate (default 0.02)
+**/
+class PsiTrialGenerator
+{
+public:
+	PsiTrialGenerator() : current(0), maxTrials(40), targetSD(0), randomStream(0) {}
+
+	// Stream used to interleave the conditions, rand() is used if none is set
+	void setRandomStream(RandomStream *stream)
+	{
+		randomStream = stream;
+	}
+
+	// False, with a message, if the keys do not give a usable grid of levels and slopes
+	bool init(const std::string &parametersFileName)
+	{
+		std::map<std::string, std::string> lines = readParameterLines(parametersFileName);
+		maxTrials = findParameter<int>(lines, "sPsiMaxTrials", 40);
+		targetSD = findParameter<double>(lines, "sPsiTargetSD", 0.0);
+		double levelStep = findParameter<double>(lines, "sPsiLevelStep", 0.5);
+		double lapse = findParameter<double>(lines, "sPsiLapse", 0.02);
+		double lower = findParameter<double>(lines, "sStairClampLower", 1.0);
+		double upper = findParameter<double>(lines, "sStairClampUpper", 30.0);
+		std::vector<double> slopes = parameterList<double>(findParameter(lines, "sPsiSlopes", "0.25,0.5,1,2,4"));
+		if (!(levelStep > 0))
+		{
+			std::cerr << "sPsiLevelStep must be positive, not " << levelStep << std::endl;
+			return false;
+		}
+		if (!(lower <= upper))
+		{
+			std::cerr << "sStairClampLower (" << lower << ") must not be above sStairClampUpper (" << upper << ")" << std::endl;
+			return false;
+		}
+		if (slopes.empty())
+		{
+			std::cerr << "sPsiSlopes has no slopes" << std::endl;
+			return false;
+		}
+		if (!(lapse > 0 && lapse < 1))
+		{
+			std::cerr << "sPsiLapse must be between 0 and 1 (exclusive), not " << lapse << std::endl;
+			return false;
+		}
+
+		std::vector<double> levels;
+		for (double x = lower; x <= upper + 1E-9; x += levelStep)
+			levels.push_back(x);
+
+		// every combination of the factor levels
+		conditions.assign(1, std::map<std::string, double>());
+		std::map<std::string, std::vector<double> > factors = parameterFactors(lines);
+		for (std::map<std::string, std::vector<double> >::const_iterator iter = factors.begin(); iter != factors.end(); ++iter)
+		{
+			std::vector< std::map<std::string, double> > expanded;
+			for (size_t c = 0; c < conditions.size(); c++)
+			{
+				for (size_t l = 0; l < iter->second.size(); l++)
+				{
+					std::map<std::string, double> condition = conditions[c];
+					condition[iter->first] = iter->second[l];
+					expanded.push_back(condition);
+				}
+			}
+			conditions.swap(expanded);
+		}
+
+		staircases.assign(conditions.size(), PsiStaircase());
+		for (size_t c = 0; c < conditions.size(); c++)
+			staircases[c].init(levels, levels, slopes, lapse);
+
+		current = pickCondition();
+		return true;
+	}
+
+	std::pair<std::map<std::string, double>, PsiStaircase*> getCurrent()
+	{
+		return std::make_pair(conditions[current], &staircases[current]);
+	}
+
+	// Feeds the answer of the current trial and moves to a random unfinished condition
+	void next(bool answer)
+	{
+		staircases[current].step(answer);
+		if (!isEmpty())
+			current = pickCondition();
+	}
+
+	// True when every condition has reached its stopping criterion
+	bool isEmpty() const
+	{
+		for (size_t c = 0; c < staircases.size(); c++)
+			if (!isDone(c))
+				return false;
+		return true;
+	}
+
+	bool isDone(size_t condition) const
+	{
+		const PsiStaircase &psi = staircases[condition];
+		return psi.getStepsDone() >= maxTrials || (targetSD > 0 && psi.getStepsDone() > 0 && psi.getThresholdSD() < targetSD);
+	}
+
+	size_t size() const { return conditions.size(); }
+	const std::map<std::string, double> &getCondition(size_t condition) const { return conditions[condition]; }
+	const PsiStaircase &getStaircase(size_t condition) const { return staircases[condition]; }
+
+private:
+	std::vector< std::map<std::string, double> > conditions;
+	std::vector<PsiStaircase> staircases;
+	size_t current;
+	int maxTrials;
+	double targetSD;
+	RandomStream *randomStream;
+
+	size_t pickCondition() const
+	{
+		std::vector<size_t> open;
+		for (size_t c = 0; c < staircases.size(); c++)
+			if (!isDone(c))
+				open.push_back(c);
+		if (open.empty())
+			return current;
+		if (randomStream)
+			return open[randomStream->uniformInt((int)open.size())];
+		return open[rand() % open.size()];
+	}
+};
+
+#endif
@@ -0,0 +1,247 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _REALTIME_PROFILE_H_
+#define _REALTIME_PROFILE_H_
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+/**
+* \brief How the time critical threads are scheduled, set by "--realtime [renderCore]
+* [acquisitionCore]". A core of -1 leaves the thread free to move.
+**/
+struct RealtimeProfile
+{
+	bool enabled;
+	int renderCore;
+	int acquisitionCore;
+
+	RealtimeProfile() : enabled(false), renderCore(1), acquisitionCore(2)
+	{
+	}
+};
+
+// Touches the stack the thread will use, so that its pages are mapped (and locked) now
+// rather than on the first deep call of a frame
+inline void prefaultStack()
+{
+	const int size = 256*1024;
+	unsigned char stack[size];
+	volatile unsigned char *page = stack;
+	for (int i = 0; i < size; i += 4096)
+		page[i] = 0;
+}
+
+#ifdef _WIN32
+// Number of timeBeginPeriod(1) calls still to be matched by a timeEndPeriod(1)
+inline volatile LONG &timerResolutionRequests()
+{
+	static volatile LONG requests = 0;
+	return requests;
+}
+#endif
+
+// Asks for a 1 ms timer resolution on Windows, for the sleeps of the time critical threads;
+// it stays in force for the whole system until releaseTimerResolution()
+inline void requestTimerResolution()
+{
+#ifdef _WIN32
+	if (timeBeginPeriod(1) == TIMERR_NOERROR)
+		InterlockedIncrement(&timerResolutionRequests());
+#endif
+}
+
+// Ends every request made with requestTimerResolution(), once the threads have stopped
+inline void releaseTimerResolution()
+{
+#ifdef _WIN32
+	for (LONG requests = InterlockedExchange(&timerResolutionRequests(), 0); requests > 0; requests--)
+		timeEndPeriod(1);
+#endif
+}
+
+// Keeps the pages of the process in memory: mlockall() on Linux, a large minimum working
+// set on Windows. Needs privileges (CAP_IPC_LOCK, or a high RLIMIT_MEMLOCK) on Linux.
+inline bool lockProcessMemory()
+{
+#ifdef _WIN32
+	return SetProcessWorkingSetSize(GetCurrentProcess(), 256*1024*1024, 512*1024*1024) != 0;
+#elif defined(__linux__)
+	return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#else
+	return false;
+#endif
+}
+
+// Pins the calling thread to one core
+inline bool pinCurrentThread(int core)
+{
+	if (core < 0)
+		return true;
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) != 0;
+#elif defined(__linux__)
+	cpu_set_t cores;
+	CPU_ZERO(&cores);
+	CPU_SET(core, &cores);
+	return pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0;
+#else
+	return false;
+#endif
+}
+
+// Moves the calling thread to the highest priority: time critical in a high priority
+// process (with a 1 ms timer resolution) on Windows, SCHED_FIFO on Linux. The priority
+// class applies to every thread of the process, so it is not the real-time class, which
+// would put the polling input thread above the system threads.
+inline bool raiseCurrentThreadPriority()
+{
+#ifdef _WIN32
+	requestTimerResolution();
+	SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS);
+	return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#elif defined(__linux__)
+	sched_param parameters;
+	parameters.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	return pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters) == 0;
+#else
+	return false;
+#endif
+}
+
+// Pins and raises the calling thread and prefaults its stack; false if any step failed
+inline bool makeCurrentThreadRealtime(int core)
+{
+	bool pinned = pinCurrentThread(core);
+	bool raised = raiseCurrentThreadPriority();
+	prefaultStack();
+	return pinned && raised;
+}
+
+// Applied from the thread that runs the render loop, once everything is allocated so that
+// the memory lock covers it
+inline void applyRenderThreadProfile(const RealtimeProfile &profile)
+{
+	if (!profile.enabled)
+		return;
+	if (!lockProcessMemory())
+		std::cerr << "Memory could not be locked" << std::endl;
+	if (!makeCurrentThreadRealtime(profile.renderCore))
+		std::cerr << "Render thread: real-time scheduling not (fully) available" << std::endl;
+}
+
+/**
+* \class JitterMonitor
+* \brief Distribution of a timing quantity (frame intervals, wake up delays) in ms, kept in
+* a histogram allocated up front so that adding a value never allocates.
+**/
+class JitterMonitor
+{
+public:
+	JitterMonitor(double _binMs=0.05, double rangeMs=100) :
+		binMs(_binMs), bins((size_t)(rangeMs/_binMs) + 1, 0)
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		std::fill(bins.begin(), bins.end(), 0);
+		count = 0;
+		sum = sumSquares = maximum = 0;
+	}
+
+	void add(double ms)
+	{
+		ms = std::max(ms, 0.0);
+		bins[std::min((size_t)(ms/binMs), bins.size()-1)]++;
+		count++;
+		sum += ms;
+		sumSquares += ms*ms;
+		maximum = std::max(maximum, ms);
+	}
+
+	unsigned long getCount() const { return count; }
+	double getMean() const { return count ? sum/count : 0; }
+	double getMax() const { return maximum; }
+
+	double getSD() const
+	{
+		if (count < 2)
+			return 0;
+		double mean = getMean();
+		return sqrt(std::max(0.0, sumSquares/count - mean*mean));
+	}
+
+	// Upper edge of the bin holding the given percentile
+	double getPercentile(double percentile) const
+	{
+		unsigned long rank = (unsigned long)(percentile/100*count), seen = 0;
+		for (size_t i = 0; i < bins.size(); i++)
+		{
+			seen += bins[i];
+			if (seen > rank)
+				return std::min((i+1)*binMs, maximum);
+		}
+		return maximum;
+	}
+
+	// Number of values over limit, to the resolution of a bin
+	unsigned long countOver(double limit) const
+	{
+		unsigned long over = 0;
+		for (size_t i = (size_t)(limit/binMs) + 1; i < bins.size(); i++)
+			over += bins[i];
+		return over;
+	}
+
+	void report(std::ostream &out, const std::string &name, double limit) const
+	{
+		out << std::fixed << std::setprecision(3) << name << "\t" << count << "\t" << getMean() << "\t" <<
+			getSD() << "\t" << getPercentile(99) << "\t" << getMax() << "\t" << countOver(limit) << std::endl;
+	}
+
+private:
+	double binMs;
+	std::vector<unsigned long> bins;
+	unsigned long count;
+	double sum, sumSquares, maximum;
+};
+
+#endif
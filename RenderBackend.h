@@ -0,0 +1,299 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _RENDER_BACKEND_H_
+#define _RENDER_BACKEND_H_
+
+#include <iostream>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenGL/OpenGL.h>
+#include <GLUT/glut.h>
+#endif
+
+#ifdef __linux__
+#include <GL/glut.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#include <gl\gl.h>
+#include "glut.h"
+#endif
+
+// Define GRAVITY_OFFSCREEN (and link libEGL) to build the offscreen backend
+#ifdef GRAVITY_OFFSCREEN
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+enum Eye
+{
+	LEFT_EYE = 0,
+	RIGHT_EYE = 1
+};
+
+/**
+* \class RenderBackend
+* \brief Where drawGLScene() draws the two eye views.
+*
+* drawGLScene() calls beginEye() before drawing each eye and swap() at the end of the frame;
+* readEye() reads back the eye that was begun last, before the next beginEye().
+**/
+class RenderBackend
+{
+public:
+	RenderBackend() : width(0), height(0) {}
+	virtual ~RenderBackend() {}
+
+	// Creates the window or the offscreen buffers and makes the GL context current
+	virtual bool init(int *argc, char *argv[], int _width, int _height) = 0;
+	virtual void beginEye(Eye eye) = 0;
+	virtual void swap() = 0;
+	virtual bool isOffscreen() const { return false; }
+	// Refresh rate the display reports in Hz, 0 if unknown
+	virtual double getRefreshRate() const { return 0; }
+
+	// RGB pixels of the current eye, bottom row first as returned by glReadPixels
+	virtual void readEye(std::vector<unsigned char> &pixels)
+	{
+		pixels.resize(width*height*3);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+protected:
+	int width, height;
+};
+
+/**
+* \class GlutStereoBackend
+* \brief The experiment display: GLUT game mode with quad-buffered stereo.
+**/
+class GlutStereoBackend : public RenderBackend
+{
+public:
+	GlutStereoBackend(const char *_gameModeString) : gameModeString(_gameModeString), eye(LEFT_EYE) {}
+
+	bool init(int *argc, char *argv[], int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		glutInit(argc, argv);
+		glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_STEREO);
+		glutGameModeString(gameModeString);
+		glutEnterGameMode();
+		return true;
+	}
+
+	void beginEye(Eye _eye)
+	{
+		eye = _eye;
+		glDrawBuffer(GL_BACK);
+		glDrawBuffer(eye == LEFT_EYE ? GL_BACK_LEFT : GL_BACK_RIGHT);
+	}
+
+	void readEye(std::vector<unsigned char> &pixels)
+	{
+		glReadBuffer(eye == LEFT_EYE ? GL_BACK_LEFT : GL_BACK_RIGHT);
+		RenderBackend::readEye(pixels);
+	}
+
+	void swap()
+	{
+		glutSwapBuffers();
+	}
+
+	double getRefreshRate() const
+	{
+		int rate = glutGameModeGet(GLUT_GAME_MODE_REFRESH_RATE);
+		return rate > 0 ? rate : 0;
+	}
+
+private:
+	const char *gameModeString;
+	Eye eye;
+};
+
+/**
+* \class GlutWindowBackend
+* \brief A plain double buffered window, both eyes are drawn in turn into the same back buffer.
+**/
+class GlutWindowBackend : public RenderBackend
+{
+public:
+	GlutWindowBackend(const char *_title) : title(_title) {}
+
+	bool init(int *argc, char *argv[], int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+		glutInit(argc, argv);
+		glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+		glutInitWindowSize(width, height);
+		glutCreateWindow(title);
+		return true;
+	}
+
+	void beginEye(Eye eye)
+	{
+		glDrawBuffer(GL_BACK);
+		glReadBuffer(GL_BACK);
+	}
+
+	void swap()
+	{
+		glutSwapBuffers();
+	}
+
+private:
+	const char *title;
+};
+
+#ifdef GRAVITY_OFFSCREEN
+/**
+* \class EGLOffscreenBackend
+* \brief Headless rendering through EGL: one pbuffer per eye sharing a single desktop GL
+* context, so the fixed function state set by initRendering() applies to both eyes.
+* Works without a display server (falls back to Mesa's surfaceless platform).
+**/
+class EGLOffscreenBackend : public RenderBackend
+{
+public:
+	EGLOffscreenBackend() : display(EGL_NO_DISPLAY), context(EGL_NO_CONTEXT)
+	{
+		surfaces[LEFT_EYE] = surfaces[RIGHT_EYE] = EGL_NO_SURFACE;
+	}
+
+	~EGLOffscreenBackend()
+	{
+		if (display == EGL_NO_DISPLAY)
+			return;
+		eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		for (int i = 0; i < 2; i++)
+			if (surfaces[i] != EGL_NO_SURFACE)
+				eglDestroySurface(display, surfaces[i]);
+		if (context != EGL_NO_CONTEXT)
+			eglDestroyContext(display, context);
+		eglTerminate(display);
+	}
+
+	bool init(int *argc, char *argv[], int _width, int _height)
+	{
+		width = _width;
+		height = _height;
+
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+		{
+			PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+			if (getPlatformDisplay)
+				display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+			if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+			{
+				std::cerr << "EGL: no display available" << std::endl;
+				return false;
+			}
+		}
+		eglBindAPI(EGL_OPENGL_API);
+
+		const EGLint configAttributes[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+			EGL_DEPTH_SIZE, 24,
+			EGL_NONE };
+		EGLConfig config;
+		EGLint numConfigs = 0;
+		if (!eglChooseConfig(display, configAttributes, &config, 1, &numConfigs) || numConfigs < 1)
+		{
+			std::cerr << "EGL: no pbuffer configuration" << std::endl;
+			return false;
+		}
+
+		const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+		for (int i = 0; i < 2; i++)
+		{
+			surfaces[i] = eglCreatePbufferSurface(display, config, surfaceAttributes);
+			if (surfaces[i] == EGL_NO_SURFACE)
+			{
+				std::cerr << "EGL: cannot create the eye buffers" << std::endl;
+				return false;
+			}
+		}
+
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+		if (context == EGL_NO_CONTEXT)
+		{
+			std::cerr << "EGL: cannot create the context" << std::endl;
+			return false;
+		}
+		beginEye(LEFT_EYE);
+		return true;
+	}
+
+	// pbuffers have a single color buffer, the default draw and read buffers are already right
+	void beginEye(Eye eye)
+	{
+		eglMakeCurrent(display, surfaces[eye], surfaces[eye], context);
+	}
+
+	void swap()
+	{
+		glFinish();
+	}
+
+	bool isOffscreen() const { return true; }
+
+private:
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface surfaces[2];
+};
+#endif
+
+// Initializes the backend and makes its context current; deletes it and returns NULL if
+// that fails
+inline RenderBackend *openBackend(RenderBackend *backend, int *argc, char *argv[], int width, int height)
+{
+	if (backend->init(argc, argv, width, height))
+		return backend;
+	delete backend;
+	return NULL;
+}
+
+// The experiment display, or a plain window when the rig is simulated (a developer machine
+// usually has no quad-buffered stereo)
+inline RenderBackend *openDisplay(bool simulated, const char *gameModeString, int *argc, char *argv[], int width, int height)
+{
+	if (simulated)
+		return openBackend(new GlutWindowBackend("Gravity"), argc, argv, width, height);
+	return openBackend(new GlutStereoBackend(gameModeString), argc, argv, width, height);
+}
+
+#endif
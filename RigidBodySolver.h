@@ -0,0 +1,152 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _RIGID_BODY_SOLVER_H_
+#define _RIGID_BODY_SOLVER_H_
+
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "Marker.h"
+
+/**
+* \class RigidBodySolver
+* \brief Tracks points rigidly attached to triplets of markers, like CoordinatesExtractor,
+* but solves every body of a frame in one pass.
+*
+* Each body is three marker indices plus a point expressed in the orthonormal frame those
+* markers define (origin on the first marker, x towards the second, z normal to the
+* plane of the three). The bodies are stored by coordinate, one column per coordinate
+* and one row per body, so gathering, normalizing, the cross products and the final
+* transform are element-wise array operations over all bodies that Eigen vectorizes.
+* Several points on the same markers (a fingertip and its joint) are just more bodies.
+**/
+class RigidBodySolver
+{
+public:
+	typedef Eigen::Array<double, Eigen::Dynamic, 3> Coordinates;
+
+	// Adds a body on markers m1, m2, m3 and returns its index
+	int addBody(int m1, int m2, int m3)
+	{
+		int n = size();
+		indices.conservativeResize(n+1, 3);
+		indices.row(n) << m1, m2, m3;
+		local.conservativeResize(n+1, 3);
+		local.row(n).setZero();
+		points.conservativeResize(n+1, 3);
+		points.row(n).setZero();
+		calibrated.push_back(false);
+		visible.push_back(false);
+		A.resize(n+1, 3);
+		B.resize(n+1, 3);
+		C.resize(n+1, 3);
+		return n;
+	}
+
+	int size() const { return (int)indices.rows(); }
+
+	// Attaches point to the body, with the markers where they are now
+	void init(int body, const Eigen::Vector3d &point, const std::vector<Marker> &markers)
+	{
+		gather(markers);
+		Coordinates u, v, n;
+		frames(u, v, n);
+		Eigen::Array3d d = point.array() - A.row(body).transpose();
+		local(body,0) = (u.row(body).transpose()*d).sum();
+		local(body,1) = (v.row(body).transpose()*d).sum();
+		local(body,2) = (n.row(body).transpose()*d).sum();
+		calibrated[body] = true;
+		points.row(body) = point.transpose();
+	}
+
+	// Updates every calibrated body whose three markers are visible
+	void solve(const std::vector<Marker> &markers)
+	{
+		gather(markers);
+		Coordinates u, v, n;
+		frames(u, v, n);
+		Coordinates solved = A
+			+ u.colwise()*local.col(0)
+			+ v.colwise()*local.col(1)
+			+ n.colwise()*local.col(2);
+		for (int b = 0; b < size(); b++)
+		{
+			visible[b] = calibrated[b] && isVisible(markers[indices(b,0)].p) && isVisible(markers[indices(b,1)].p) && isVisible(markers[indices(b,2)].p);
+			if (visible[b])
+				points.row(b) = solved.row(b);
+		}
+	}
+
+	// True if the last solve() updated the body
+	bool isBodyVisible(int body) const { return visible[body]; }
+	bool isCalibrated(int body) const { return calibrated[body]; }
+	// Last known position of the point of the body
+	Eigen::Vector3d getPoint(int body) const { return points.row(body).transpose(); }
+
+	// The Optotrak reports occluded markers with huge coordinates
+	static bool isVisible(const Eigen::Vector3d &p)
+	{
+		return p.cwiseAbs().maxCoeff() < 1E20;
+	}
+
+private:
+	Eigen::Array<int, Eigen::Dynamic, 3> indices;
+	Coordinates local, points;
+	Coordinates A, B, C;
+	std::vector<bool> calibrated, visible;
+
+	void gather(const std::vector<Marker> &markers)
+	{
+		for (int b = 0; b < size(); b++)
+		{
+			A.row(b) = markers[indices(b,0)].p.transpose();
+			B.row(b) = markers[indices(b,1)].p.transpose();
+			C.row(b) = markers[indices(b,2)].p.transpose();
+		}
+	}
+
+	// Orthonormal frame of every body
+	void frames(Coordinates &u, Coordinates &v, Coordinates &n) const
+	{
+		u = B - A;
+		Coordinates w = C - A;
+		u.colwise() /= u.square().rowwise().sum().sqrt();
+		cross(u, w, n);
+		n.colwise() /= n.square().rowwise().sum().sqrt();
+		cross(n, u, v);
+	}
+
+	static void cross(const Coordinates &a, const Coordinates &b, Coordinates &c)
+	{
+		c.resize(a.rows(), 3);
+		c.col(0) = a.col(1)*b.col(2) - a.col(2)*b.col(1);
+		c.col(1) = a.col(2)*b.col(0) - a.col(0)*b.col(2);
+		c.col(2) = a.col(0)*b.col(1) - a.col(1)*b.col(0);
+	}
+};
+
+#endif
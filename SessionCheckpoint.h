@@ -0,0 +1,105 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _SESSION_CHECKPOINT_H_
+#define _SESSION_CHECKPOINT_H_
+
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "GravityParameters.h"
+
+/**
+* \class SessionCheckpoint
+* \brief The minimal state needed to resume an interrupted session.
+*
+* TrialGenerator, BalanceFactor and the staircases cannot be serialized, but they are
+* deterministic given the random seed and the answers they were fed. The checkpoint
+* therefore stores the seed, the number of completed trials and one response value per
+* trial; on resume the experiment rebuilds the generator with the same seed and replays
+* the responses, which brings the generator, the staircases and the random number
+* generator back to exactly where they were.
+*
+* The file uses the "Key: value" format of the parameters files and is replaced
+* atomically (written to a temporary file, then renamed) after every trial.
+**/
+class SessionCheckpoint
+{
+public:
+	SessionCheckpoint() : seed(0), trials(0), finished(false), nextState(0), hasNextState(false) {}
+
+	bool load(const std::string &fileName)
+	{
+		std::ifstream file(fileName.c_str());
+		if (!file.is_open())
+			return false;
+		file.close();
+
+		std::map<std::string, std::string> lines = readParameterLines(fileName);
+		seed = findParameter<unsigned int>(lines, "Seed", 0);
+		trials = findParameter<int>(lines, "Trials", 0);
+		finished = findParameter<int>(lines, "Finished", 0) != 0;
+		responses = parameterList<double>(findParameter(lines, "Responses", ""));
+		hasNextState = lines.find("NextState") != lines.end();
+		nextState = findParameter<double>(lines, "NextState", 0.0);
+		return true;
+	}
+
+	bool save(const std::string &fileName) const
+	{
+		std::string temporaryName = fileName + ".tmp";
+		{
+			std::ofstream file(temporaryName.c_str());
+			if (!file.is_open())
+				return false;
+			file << std::setprecision(10);
+			file << "# Session checkpoint, rewritten after every trial" << std::endl;
+			file << "Seed: " << seed << std::endl;
+			file << "Trials: " << trials << std::endl;
+			file << "Finished: " << (finished ? 1 : 0) << std::endl;
+			file << "Responses: ";
+			for (size_t i = 0; i < responses.size(); i++)
+				file << (i ? "," : "") << responses[i];
+			file << std::endl;
+			if (hasNextState)
+				file << "NextState: " << nextState << std::endl;
+		}
+		// rename() does not replace an existing file on Windows
+		std::remove(fileName.c_str());
+		return std::rename(temporaryName.c_str(), fileName.c_str()) == 0;
+	}
+
+	unsigned int seed;
+	int trials;
+	bool finished;
+	std::vector<double> responses;
+	double nextState;
+	bool hasNextState;
+};
+
+#endif
@@ -0,0 +1,400 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _SHADER_PIPELINE_H_
+#define _SHADER_PIPELINE_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+// Define GRAVITY_SHADERS (and link GLEW) to build the shader pipeline. GL/glew.h must be
+// included before any other GL header, so the programs include it first.
+#ifdef GRAVITY_SHADERS
+#include <GL/glew.h>
+#endif
+
+/**
+* \class ShaderPipeline
+* \brief Per-pixel lighting of the surfaces and analytic sphere impostors for the balls.
+*
+* The light of initRendering() and the materials are kept in two uniform blocks: Eye holds
+* the projection and modelview that the camera set for the current eye, the eye position
+* and the light, Materials the colors registered with addMaterial(). beginEye() uploads both
+* after each cam.setEye(); the materials are read again then, so a change of a material
+* array shows in the next eye.
+*
+* A sphere is a single quad facing the eye and large enough to cover its silhouette; the
+* fragment shader intersects the view ray with the sphere, lights the hit point and writes
+* its depth, so the balls are exact spheres whatever their size on the screen.
+* drawSpheres() draws many of them in one call, one instance of the quad per sphere, where
+* the driver has instanced arrays (otherwise one call per sphere).
+* Lighting follows the fixed-function model the program used: global ambient 0.2, light
+* ambient and diffuse, no specular, a positional light given in eye coordinates.
+* Without GRAVITY_SHADERS, or if the driver lacks GLSL or uniform buffers, init() fails and
+* the program keeps drawing through the fixed-function pipeline.
+**/
+class ShaderPipeline
+{
+public:
+	ShaderPipeline() : available(false)
+	{
+	}
+
+	// Up to maxMaterials colors (RGBA, ambient and diffuse), read at every beginEye()
+	int addMaterial(const float *color)
+	{
+		materials.push_back(color);
+		return (int)materials.size() - 1;
+	}
+
+	bool isAvailable() const { return available; }
+
+#ifdef GRAVITY_SHADERS
+	bool init(const float *lightPosition, const float *lightAmbient, const float *lightDiffuse)
+	{
+		if (glewInit() != GLEW_OK || !GLEW_VERSION_2_0 || !GLEW_ARB_uniform_buffer_object)
+		{
+			std::cerr << "Shaders: GLSL or uniform buffers not supported, fixed-function rendering" << std::endl;
+			return false;
+		}
+		surfaceProgram = link(surfaceVertexShader(), surfaceFragmentShader());
+		sphereProgram = link(sphereVertexShader(), sphereFragmentShader());
+		if (!surfaceProgram || !sphereProgram)
+			return false;
+		surfaceMaterial = glGetUniformLocation(surfaceProgram, "material");
+		sphereMaterial = glGetUniformLocation(sphereProgram, "material");
+		sphere = glGetUniformLocation(sphereProgram, "sphere");
+
+		instancedProgram = 0;
+		if (GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced)
+			instancedProgram = link(instancedSphereVertexShader(), sphereFragmentShader(), "instanceSphere");
+		if (instancedProgram)
+		{
+			instancedMaterial = glGetUniformLocation(instancedProgram, "material");
+			const float corners[] = { -1, -1, 1, -1, 1, 1, -1, 1 };
+			glGenBuffers(1, &cornerBuffer);
+			glBindBuffer(GL_ARRAY_BUFFER, cornerBuffer);
+			glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+			glGenBuffers(1, &instanceBuffer);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		for (int i = 0; i < 4; i++)
+		{
+			light[i] = lightPosition[i];
+			light[4+i] = lightAmbient[i];
+			light[8+i] = lightDiffuse[i];
+		}
+		glGenBuffers(1, &eyeBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, eyeBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, eyeBlockSize, NULL, GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &materialBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, materialBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, maxMaterials*4*sizeof(float), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, 0, eyeBuffer);
+		glBindBufferBase(GL_UNIFORM_BUFFER, 1, materialBuffer);
+
+		GLuint programs[] = { surfaceProgram, sphereProgram, instancedProgram };
+		for (int p = 0; p < (instancedProgram ? 3 : 2); p++)
+		{
+			glUniformBlockBinding(programs[p], glGetUniformBlockIndex(programs[p], "Eye"), 0);
+			glUniformBlockBinding(programs[p], glGetUniformBlockIndex(programs[p], "Materials"), 1);
+		}
+		available = true;
+		return true;
+	}
+
+	// Called after the camera has set the matrices of an eye, eye in the same coordinates
+	// as the stimulus (the modelview is the identity while it is drawn)
+	void beginEye(const Eigen::Vector3d &eye)
+	{
+		if (!available)
+			return;
+		// std140: two mat4, then eye position and light as four vec4
+		float block[eyeBlockSize/sizeof(float)];
+		glGetFloatv(GL_PROJECTION_MATRIX, block);
+		glGetFloatv(GL_MODELVIEW_MATRIX, block + 16);
+		block[32] = (float)eye.x();
+		block[33] = (float)eye.y();
+		block[34] = (float)eye.z();
+		block[35] = 1;
+		for (int i = 0; i < 12; i++)
+			block[36+i] = light[i];
+		glBindBuffer(GL_UNIFORM_BUFFER, eyeBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, eyeBlockSize, block);
+
+		float colors[maxMaterials*4];
+		for (size_t m = 0; m < materials.size() && m < (size_t)maxMaterials; m++)
+			for (int i = 0; i < 4; i++)
+				colors[m*4+i] = materials[m][i];
+		glBindBuffer(GL_UNIFORM_BUFFER, materialBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, materials.size()*4*sizeof(float), colors);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	// The geometry drawn next (glBegin/glVertex) is lit per pixel with this material
+	void useMaterial(int material)
+	{
+		if (!available)
+			return;
+		glUseProgram(surfaceProgram);
+		glUniform1i(surfaceMaterial, material);
+	}
+
+	void drawSphere(const Eigen::Vector3d &center, double radius, int material)
+	{
+		if (!available)
+			return;
+		glUseProgram(sphereProgram);
+		glUniform1i(sphereMaterial, material);
+		glUniform4f(sphere, (float)center.x(), (float)center.y(), (float)center.z(), (float)radius);
+		glBegin(GL_QUADS);
+		glVertex2f(-1, -1);
+		glVertex2f(1, -1);
+		glVertex2f(1, 1);
+		glVertex2f(-1, 1);
+		glEnd();
+	}
+
+	// count spheres packed as x, y, z, radius (BallSystem::getSpheres())
+	void drawSpheres(const float *spheres, int count, int material)
+	{
+		if (!available || count <= 0)
+			return;
+		if (!instancedProgram)
+		{
+			for (int i = 0; i < count; i++)
+				drawSphere(Eigen::Vector3d(spheres[4*i], spheres[4*i+1], spheres[4*i+2]), spheres[4*i+3], material);
+			return;
+		}
+		glUseProgram(instancedProgram);
+		glUniform1i(instancedMaterial, material);
+		glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, count*4*sizeof(float), spheres, GL_STREAM_DRAW);
+		glEnableVertexAttribArray(instanceAttribute);
+		glVertexAttribPointer(instanceAttribute, 4, GL_FLOAT, GL_FALSE, 0, 0);
+		glVertexAttribDivisorARB(instanceAttribute, 1);
+		glBindBuffer(GL_ARRAY_BUFFER, cornerBuffer);
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glVertexPointer(2, GL_FLOAT, 0, 0);
+		glDrawArraysInstancedARB(GL_QUADS, 0, 4, count);
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glVertexAttribDivisorARB(instanceAttribute, 0);
+		glDisableVertexAttribArray(instanceAttribute);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	// Back to fixed-function, for the text and everything not drawn through the pipeline
+	void end()
+	{
+		if (available)
+			glUseProgram(0);
+	}
+
+private:
+	static const int maxMaterials = 8;
+	static const int eyeBlockSize = (16 + 16 + 4*4)*sizeof(float);
+	bool available;
+	std::vector<const float *> materials;
+	float light[12];
+	// Generic attribute 1 is not aliased to any of the built-in ones
+	static const GLuint instanceAttribute = 1;
+	GLuint surfaceProgram, sphereProgram, instancedProgram;
+	GLint surfaceMaterial, sphereMaterial, sphere, instancedMaterial;
+	GLuint eyeBuffer, materialBuffer, cornerBuffer, instanceBuffer;
+
+	static GLuint compile(GLenum type, const char *source)
+	{
+		GLuint shader = glCreateShader(type);
+		glShaderSource(shader, 1, &source, NULL);
+		glCompileShader(shader);
+		GLint compiled = 0;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+		if (!compiled)
+		{
+			char log[4096];
+			glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+			std::cerr << "Shader compilation failed:" << std::endl << log << std::endl;
+			glDeleteShader(shader);
+			return 0;
+		}
+		return shader;
+	}
+
+	static GLuint link(const char *vertexSource, const char *fragmentSource, const char *instanceName=NULL)
+	{
+		GLuint vertex = compile(GL_VERTEX_SHADER, vertexSource);
+		GLuint fragment = compile(GL_FRAGMENT_SHADER, fragmentSource);
+		if (!vertex || !fragment)
+			return 0;
+		GLuint program = glCreateProgram();
+		glAttachShader(program, vertex);
+		glAttachShader(program, fragment);
+		if (instanceName)
+			glBindAttribLocation(program, instanceAttribute, instanceName);
+		glLinkProgram(program);
+		glDeleteShader(vertex);
+		glDeleteShader(fragment);
+		GLint linked = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked)
+		{
+			char log[4096];
+			glGetProgramInfoLog(program, sizeof(log), NULL, log);
+			std::cerr << "Shader link failed:" << std::endl << log << std::endl;
+			glDeleteProgram(program);
+			return 0;
+		}
+		return program;
+	}
+
+	static const char *surfaceVertexShader();
+	static const char *surfaceFragmentShader();
+	static const char *sphereVertexShader();
+	static const char *instancedSphereVertexShader();
+	static const char *sphereFragmentShader();
+#else
+	bool init(const float *, const float *, const float *) { return false; }
+	void beginEye(const Eigen::Vector3d &) {}
+	void useMaterial(int) {}
+	void drawSphere(const Eigen::Vector3d &, double, int) {}
+	void drawSpheres(const float *, int, int) {}
+	void end() {}
+
+private:
+	bool available;
+	std::vector<const float *> materials;
+#endif
+};
+
+#ifdef GRAVITY_SHADERS
+#define GRAVITY_GLSL_HEADER \
+	"#version 120\n" \
+	"#extension GL_ARB_uniform_buffer_object : require\n" \
+	"layout(std140) uniform Eye { mat4 projection; mat4 modelView; vec4 eyePosition; vec4 lightPosition; vec4 lightAmbient; vec4 lightDiffuse; };\n" \
+	"layout(std140) uniform Materials { vec4 colors[8]; };\n" \
+	"uniform int material;\n" \
+	"vec4 shade(vec3 position, vec3 normal)\n" \
+	"{\n" \
+	"	vec3 toLight = normalize(lightPosition.xyz - position);\n" \
+	"	vec4 color = colors[material];\n" \
+	"	vec3 rgb = color.rgb*(vec3(0.2) + lightAmbient.rgb + lightDiffuse.rgb*max(dot(normal, toLight), 0.0));\n" \
+	"	return vec4(clamp(rgb, 0.0, 1.0), color.a);\n" \
+	"}\n"
+
+// gl_Normal is the current normal, (0,0,1) unless the program sets one
+inline const char *ShaderPipeline::surfaceVertexShader()
+{
+	return GRAVITY_GLSL_HEADER
+		"varying vec3 position;\n"
+		"varying vec3 normal;\n"
+		"void main()\n"
+		"{\n"
+		"	vec4 eyeVertex = modelView*gl_Vertex;\n"
+		"	position = eyeVertex.xyz;\n"
+		"	normal = mat3(modelView)*gl_Normal;\n"
+		"	gl_Position = projection*eyeVertex;\n"
+		"}\n";
+}
+
+inline const char *ShaderPipeline::surfaceFragmentShader()
+{
+	return GRAVITY_GLSL_HEADER
+		"varying vec3 position;\n"
+		"varying vec3 normal;\n"
+		"void main()\n"
+		"{\n"
+		"	gl_FragColor = shade(position, normalize(normal));\n"
+		"}\n";
+}
+
+// The quad is perpendicular to the line of sight through the center, with the half size
+// at which the cone tangent to the sphere crosses it
+#define GRAVITY_GLSL_SPHERE_QUAD \
+	"varying vec4 ball;\n" \
+	"varying vec3 position;\n" \
+	"void quad(vec4 sphere)\n" \
+	"{\n" \
+	"	ball = sphere;\n" \
+	"	vec3 toEye = eyePosition.xyz - sphere.xyz;\n" \
+	"	float dist = length(toEye);\n" \
+	"	vec3 forward = toEye/dist;\n" \
+	"	vec3 right = normalize(cross(abs(forward.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), forward));\n" \
+	"	vec3 up = cross(forward, right);\n" \
+	"	float size = sphere.w*dist/sqrt(max(dist*dist - sphere.w*sphere.w, 1e-6));\n" \
+	"	position = sphere.xyz + (gl_Vertex.x*right + gl_Vertex.y*up)*size;\n" \
+	"	gl_Position = projection*modelView*vec4(position, 1.0);\n" \
+	"}\n"
+
+inline const char *ShaderPipeline::sphereVertexShader()
+{
+	return GRAVITY_GLSL_HEADER GRAVITY_GLSL_SPHERE_QUAD
+		"uniform vec4 sphere;\n"
+		"void main()\n"
+		"{\n"
+		"	quad(sphere);\n"
+		"}\n";
+}
+
+// The sphere of the instance comes from the per-instance attribute
+inline const char *ShaderPipeline::instancedSphereVertexShader()
+{
+	return GRAVITY_GLSL_HEADER GRAVITY_GLSL_SPHERE_QUAD
+		"attribute vec4 instanceSphere;\n"
+		"void main()\n"
+		"{\n"
+		"	quad(instanceSphere);\n"
+		"}\n";
+}
+#undef GRAVITY_GLSL_SPHERE_QUAD
+
+inline const char *ShaderPipeline::sphereFragmentShader()
+{
+	return GRAVITY_GLSL_HEADER
+		"varying vec4 ball;\n"
+		"varying vec3 position;\n"
+		"void main()\n"
+		"{\n"
+		"	vec3 direction = normalize(position - eyePosition.xyz);\n"
+		"	vec3 offset = eyePosition.xyz - ball.xyz;\n"
+		"	float b = dot(offset, direction);\n"
+		"	float h = b*b - dot(offset, offset) + ball.w*ball.w;\n"
+		"	if (h < 0.0)\n"
+		"		discard;\n"
+		"	vec3 hit = eyePosition.xyz + (-b - sqrt(h))*direction;\n"
+		"	vec4 eyeHit = modelView*vec4(hit, 1.0);\n"
+		"	vec4 clip = projection*eyeHit;\n"
+		"	gl_FragDepth = 0.5*clip.z/clip.w + 0.5;\n"
+		"	gl_FragColor = shade(eyeHit.xyz, normalize(mat3(modelView)*(hit - ball.xyz)));\n"
+		"}\n";
+}
+#undef GRAVITY_GLSL_HEADER
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _SIMULATED_OBSERVER_H_
+#define _SIMULATED_OBSERVER_H_
+
+#include <cmath>
+
+/**
+* \class SimulatedObserver
+* \brief A psychometric observer that answers "the probe was faster" with a logistic
+* probability, so that staircases can be run without a subject.
+*
+* The probability of a positive answer at stimulus level x is
+*   p(x) = lapse/2 + (1-lapse) / (1 + exp(-slope*(x-pse)))
+* which is the same psychometric family used by the adaptive procedures.
+**/
+class SimulatedObserver
+{
+public:
+	SimulatedObserver(double _pse=10.0, double _slope=1.0, double _lapse=0.02) :
+		pse(_pse), slope(_slope), lapse(_lapse)
+	{
+	}
+
+	// Probability of answering true ("probe faster than cue") at the given probeSpeed
+	double probability(double level) const
+	{
+		return 0.5*lapse + (1.0-lapse)/(1.0 + exp(-slope*(level-pse)));
+	}
+
+	// Draws an answer, rng must return uniform numbers in [0,1)
+	template <typename UniformRNG>
+	bool respond(double level, UniformRNG &rng) const
+	{
+		return rng() < probability(level);
+	}
+
+	double pse;
+	double slope;
+	double lapse;
+};
+
+#endif
@@ -0,0 +1,240 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef _STARTUP_SEQUENCE_H_
+#define _STARTUP_SEQUENCE_H_
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include "GravityHardware.h"
+
+/**
+* \class StartupSequence
+* \brief Runs the initialization steps of an experiment as soon as the steps they depend
+* on are done, each on its own thread, and keeps the time every step started and ended.
+*
+* Steps added with mainThread=true (the OpenGL context and GLUT) run on the thread that
+* calls run(), the others on worker threads, started by whichever step finishes last
+* among their dependencies. run() returns when every step is done.
+* Dependencies are given with after() before run(); a step that depends on a later one
+* never runs, so they must not form a cycle.
+* A step returns false when it fails: the steps that depend on it are skipped, the others
+* still run, and run() returns false once all the workers are joined, so that the
+* program can stop from the main thread.
+**/
+class StartupSequence
+{
+public:
+	StartupSequence() : origin(0), finishedSteps(0)
+	{
+	}
+
+	int add(const std::string &name, boost::function<bool ()> function, bool mainThread=false)
+	{
+		Step step;
+		step.name = name;
+		step.function = function;
+		step.mainThread = mainThread;
+		step.state = WAITING;
+		step.start = step.end = 0;
+		steps.push_back(step);
+		return (int)steps.size() - 1;
+	}
+
+	void after(int step, int dependency)
+	{
+		steps[step].dependencies.push_back(dependency);
+	}
+
+	// True if every step succeeded
+	bool run()
+	{
+		origin = hardwareClock();
+		boost::mutex::scoped_lock lock(mutex);
+		startWorkers();
+		while (finishedSteps < steps.size())
+		{
+			int mainStep = -1;
+			for (size_t i = 0; i < steps.size() && mainStep < 0; i++)
+				if (steps[i].mainThread && steps[i].state == WAITING && isReady(i))
+					mainStep = (int)i;
+			if (mainStep >= 0)
+			{
+				steps[mainStep].state = RUNNING;
+				lock.unlock();
+				execute(mainStep);
+				lock.lock();
+			}
+			else
+				stepDone.wait(lock);
+		}
+		lock.unlock();
+		workers.join_all();
+		for (size_t i = 0; i < steps.size(); i++)
+			if (steps[i].state != DONE)
+				return false;
+		return true;
+	}
+
+	// Launch to last step done, in ms
+	double getTotalMs() const
+	{
+		double total = 0;
+		for (size_t i = 0; i < steps.size(); i++)
+			total = std::max(total, steps[i].end - origin);
+		return total;
+	}
+
+	// Time the same steps would have taken one after the other, in ms
+	double getSequentialMs() const
+	{
+		double sum = 0;
+		for (size_t i = 0; i < steps.size(); i++)
+			sum += steps[i].end - steps[i].start;
+		return sum;
+	}
+
+	// One line per step with its thread, start, end and duration in ms from run() and how it
+	// ended; a skipped step never started and has no times
+	void report(std::ostream &out) const
+	{
+		static const char *results[] = { "waiting", "running", "ok", "failed", "skipped" };
+		out << std::fixed << std::setprecision(1) << "step\tthread\tstartMs\tendMs\tdurationMs\tresult" << std::endl;
+		for (size_t i = 0; i < steps.size(); i++)
+		{
+			out << steps[i].name << "\t" << (steps[i].mainThread ? "main" : "worker") << "\t";
+			if (steps[i].state == SKIPPED)
+				out << "-\t-\t-";
+			else
+				out << steps[i].start - origin << "\t" << steps[i].end - origin << "\t" << steps[i].end - steps[i].start;
+			out << "\t" << results[steps[i].state] << std::endl;
+		}
+		out << "total\t\t0.0\t" << getTotalMs() << "\t" << getTotalMs() <<
+			"\t(" << getSequentialMs() << " in sequence)" << std::endl;
+	}
+
+	// report() to the given file, and the total to the console
+	void writeTimeline(const std::string &fileName) const
+	{
+		std::ofstream timeline(fileName.c_str());
+		report(timeline);
+		std::cerr << "Startup: " << getTotalMs() << " ms (" << getSequentialMs() << " ms in sequence)" << std::endl;
+	}
+
+private:
+	enum State { WAITING, RUNNING, DONE, FAILED, SKIPPED };
+	struct Step
+	{
+		std::string name;
+		boost::function<bool ()> function;
+		bool mainThread;
+		std::vector<int> dependencies;
+		State state;
+		double start, end;
+	};
+
+	std::vector<Step> steps;
+	double origin;
+	size_t finishedSteps;
+	boost::mutex mutex;
+	boost::condition_variable stepDone;
+	boost::thread_group workers;
+
+	// Called with the mutex locked
+	void startWorkers()
+	{
+		for (size_t i = 0; i < steps.size(); i++)
+		{
+			if (steps[i].mainThread || steps[i].state != WAITING || !isReady(i))
+				continue;
+			steps[i].state = RUNNING;
+			workers.add_thread(new boost::thread(&StartupSequence::execute, this, i));
+		}
+	}
+
+	bool isReady(size_t i) const
+	{
+		for (size_t d = 0; d < steps[i].dependencies.size(); d++)
+			if (steps[steps[i].dependencies[d]].state != DONE)
+				return false;
+		return true;
+	}
+
+	// Called with the mutex locked: skips the waiting steps that depend, even indirectly,
+	// on a failed step
+	void skipDependents()
+	{
+		bool skipped = true;
+		while (skipped)
+		{
+			skipped = false;
+			for (size_t i = 0; i < steps.size(); i++)
+			{
+				if (steps[i].state != WAITING)
+					continue;
+				for (size_t d = 0; d < steps[i].dependencies.size(); d++)
+				{
+					State dependency = steps[steps[i].dependencies[d]].state;
+					if (dependency == FAILED || dependency == SKIPPED)
+					{
+						steps[i].state = SKIPPED;
+						finishedSteps++;
+						skipped = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	void execute(size_t i)
+	{
+		double start = hardwareClock();
+		bool succeeded = steps[i].function();
+		double end = hardwareClock();
+
+		boost::mutex::scoped_lock lock(mutex);
+		steps[i].start = start;
+		steps[i].end = end;
+		steps[i].state = succeeded ? DONE : FAILED;
+		finishedSteps++;
+		if (!succeeded)
+			skipDependents();
+		startWorkers();
+		stepDone.notify_all();
+	}
+};
+
+#endif
@@ -24,6 +24,7 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <ctime>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -34,11 +35,16 @@
 #include <Eigen/Geometry>
 #include <algorithm>
 #include <queue>
+#include <sstream>
 
 /********* BOOST MULTITHREADED LIBRARY ****************/
 #include <boost/thread/thread.hpp>
 #include <boost/asio.hpp>	//include asio in order to avoid the "winsock already declared problem"
 
+#ifdef GRAVITY_SHADERS
+#include <GL/glew.h>	// before any other GL header
+#endif
+
 #ifdef __APPLE__
 #include <OpenGL/OpenGL.h>
 #include <GLUT/glut.h>
@@ -65,6 +71,7 @@
 #include "GLUtils.h"
 #include "VRCamera.h"
 #include "CoordinatesExtractor.h"
+#include "RigidBodySolver.h"
 #include "CylinderPointsStimulus.h"
 #include "EllipsoidPointsStimulus.h"
 #include "StimulusDrawer.h"
@@ -81,11 +88,36 @@
 /***** CALIBRATION FILE *****/
 #include "LatestCalibration.h"
 
+/***** DISPLAY *****/
+// #define GRAVITY_OFFSCREEN to render headless through EGL (link libEGL)
+#include "RenderBackend.h"
+#include "ShaderPipeline.h"
+#include "GpuProfiler.h"
+
+/***** HARDWARE *****/
+#include "GravityHardware.h"
+#include "MotionPredictor.h"
+#include "HeadTracking.h"
+#include "InputEvents.h"
+#include "BallSystem.h"
+#include "BallPhysics.h"
+#include "OcclusionWindows.h"
+
+/***** STARTUP *****/
+#include <boost/bind.hpp>
+#include "StartupSequence.h"
+#include "RealtimeProfile.h"
+#include "FrameScheduler.h"
+
+/***** SESSION CHECKPOINT *****/
+#include "GravityParameters.h"
+#include "SessionCheckpoint.h"
+
+/***** RANDOM STREAMS *****/
+#include "GravityRandom.h"
+
 /***** DEFINE SIMULATION *****/
 //#define SIMULATION
-#ifndef SIMULATION
-	#include <direct.h> // mkdir
-#endif
 
 /********* NAMESPACE DIRECTIVES ************************/
 using namespace std;
@@ -96,10 +128,14 @@ using namespace BrownMotorFunctions;
 using namespace BrownPhidgets;
 
 /********* #DEFINE DIRECTIVES **************************/
-#define TIMER_MS 11                               // 85 hz
 #define SCREEN_WIDTH  1024                  // 1024 pixels
 #define SCREEN_HEIGHT 768                   // 768 pixels
 
+// The stimulus speeds are in mm per frame of the 85 Hz display the experiments were
+// designed on; a frame lasts frameDurationMs, the refresh period found at startup
+const double referenceFrameMs = 11.76;
+double frameDurationMs = referenceFrameMs;
+
 double interoculardistance = 0;
 const float DEG2RAD = 3.14159/180;
 Screen screen;
@@ -109,7 +145,6 @@ double screenAlignmentZ = 0.0;
 
 /********* VARIABLES OBJECTS  **************************/
 VRCamera cam;
-Optotrak2 optotrak;
 CoordinatesExtractor headEyeCoords, thumbCoords, indexCoords, thumbJointCoords, indexJointCoords;
 Timer timer;
 Timer globalTimer;
@@ -118,6 +153,70 @@ clock_t t;
 /********* VISUALIZATION AND STIMULI *******************/
 static const bool gameMode=true;
 static const bool stereo=true;
+RenderBackend *renderBackend = NULL;
+// Built with GRAVITY_SHADERS (link GLEW) the surfaces are lit per pixel and the balls are
+// sphere impostors; "--fixed-function" keeps the fixed pipeline
+ShaderPipeline shaders;
+bool useShaders = true;
+
+/********* HARDWARE *******************/
+// Real devices on the rig. "--simulate [markerFile] [--max-speed]" (or #define SIMULATION)
+// plays back recorded markers instead and replaces the motors and the sounds;
+// "--record-markers <file>" saves the frames of the tracker for later playback.
+Tracker *tracker = NULL;
+Motors *motors = NULL;
+Audio *audio = NULL;
+MarkerStreamWriter markerRecorder;
+bool recordingMarkers = false;
+#ifdef SIMULATION
+bool simulatedHardware = true;
+#else
+bool simulatedHardware = false;
+#endif
+// The tracker is read on its own thread, which also tracks the eyes from the head markers
+AcquisitionThread *acquisition = NULL;
+double markersTime = 0;	// sample time of markers, on hardwareClock()
+
+// "--realtime [renderCore] [acquisitionCore]" pins the render and acquisition threads and
+// raises them to real-time priority; their timing goes to schedulingJitter.txt in any case
+RealtimeProfile realtimeProfile;
+
+// GPU time of the drawing phases, from timer queries in GRAVITY_SHADERS builds, with the
+// CPU frame times of the trial; both go to <subject>_frames.txt, one line per trial
+GpuProfiler gpuProfiler;
+const int gpuSurfaces = gpuProfiler.addPhase("surfaces");
+const int gpuCueBall = gpuProfiler.addPhase("cueBall");
+const int gpuProbe = gpuProfiler.addPhase("probe");
+const int gpuInfo = gpuProfiler.addPhase("info");
+JitterMonitor trialFrames;	// interval between swaps in the trial
+JitterMonitor trialDraw;	// CPU time from the start of drawGLScene() to the swap
+
+// The frame loop wakes once per refresh, "--latch <ms>" (default 4) before the vsync, to
+// read input and markers and draw; "--free-run" spins in idle() with redraws on a timer
+FrameScheduler frameScheduler;
+double latchMs = 4;
+bool freeRunning = false;
+
+// Head-tracked stereo (optional keys HeadTracking, PredictionLeadMs): 'h' attaches the
+// static eyes to the head markers, then the eyes follow the head, predicted to photon time
+bool headTracking = false;
+HeadTrackedEyes headEyes;
+
+// Key presses are queued with their time by keyboardEvent() and, for the response keys,
+// by an InputThread; idle() hands them to handleKeypress() with elapsed set to the press
+InputQueue inputQueue;
+InputThread *inputThread = NULL;
+const char *responseKeys = "+";	// 2 and 8 move the probe with the GLUT key repeat
+double trialStartClock = 0;	// hardwareClock() when timer was started
+// Probe onset, adjustments, final response and feedback of each trial on the same clock
+ResponseTimes responseTimes;
+
+// Optional key ProbeAdjustment: "steps" moves the probe by 3 mm per key event, "continuous"
+// moves it while '8' or '2' is held (ProbeStep, ProbeHoldDelayMs, ProbeMinSpeed,
+// ProbeMaxSpeed, ProbeAcceleration), with press and release read by the InputThread
+bool continuousProbe = false;
+HoldAdjuster probeAdjuster;
+const char *continuousKeys = "+28";
 
 /********* MARKERS AND 3D VECTORS ****************************/
 // fingers markers numbers
@@ -128,9 +227,24 @@ int calibration1 = 1, calibration2 = 2;
 int screen1 = 19, screen2 = 20, screen3 = 21;
 int mirror1 = 6, mirror2 = 22;
 int centercalMarker = 4;
+int head1 = 7, head2 = 8, head3 = 9;
+
+// The finger points are solved together from each frame; a joint is one more body on the
+// same markers. The thumb stays uncalibrated, and invisible, until it gets a calibration.
+RigidBodySolver handSolver;
+const int indexBody = handSolver.addBody(ind1, ind2, ind3);
+const int thumbBody = handSolver.addBody(thu1, thu2, thu3);
 
 Vector3d eyeLeft, eyeRight;
 Vector3d ind, thm;
+
+// The index is extrapolated to the time its frame reaches the screen (optional keys
+// FingerPrediction, PredictionLeadMs, PredictionMaxOcclusionMs, PredictionProcessNoise)
+MotionPredictor indexPredictor;
+PredictionMetrics indexMetrics;
+bool predictFingers = false;
+double predictionLeadMs = 18;
+double lastFingerSample = -1;
 Vector3d indexCalibrationPoint(0,0,0), thumbCalibrationPoint(0,0,0);
 
 vector <Marker> markers;
@@ -145,6 +259,19 @@ bool visibleInfo=true;
 
 /********* FILE STREAMS *************************************/
 ofstream trialFile;
+ofstream headFile;		// head motion-to-photon latency and prediction error, one line per trial
+ofstream fingersFile;	// finger latency and prediction error, one line per trial
+ofstream latencyFile;	// input-to-feedback latency, one line per session
+ofstream framesFile;	// CPU and GPU frame times, one line per trial
+SessionCheckpoint checkpoint;
+string checkpointFileName;
+bool resuming = false;
+
+/********* RANDOM STREAMS *************************************/
+RandomStream scheduleStream;	// condition order
+RandomStream probeStream;		// probePos, drawn by trial number
+RandomStream maskStream;		// mask tiles, drawn by trial and tile number
+RandomStream ballStream;		// extra ball speeds, drawn by trial and ball number
 
 /*************************************************************************************/
 /*** Everything above this point stays more or less the same between experiments.  ***/
@@ -192,11 +319,39 @@ float cueVel_y = 0;
 float cueVel_z = 0;
 float ballStartPos_z = displayDepth - 375;
 
+// Optional keys ExtraBalls (default 0), ExtraBallSpacing (mm) and ExtraBallSpeedJitter: more
+// balls roll and fall with the cue ball, in rows across the table on both sides of it
+// and behind, each at the speed of the trial scaled by 1 +- jitter
+BallSystem extraBalls;
+int extraBallCount = 0;
+double extraBallSpacing = 20;
+double extraBallSpeedJitter = 0.2;
+
+// Optional key BallPhysics: "ballistic" (default) is the parabola of online_trial() that ends
+// where the ball touches the floor; "simulated" integrates the fall with AirDrag, bounces with
+// Restitution and rolls with RollingFriction (PhysicsModel) into a trajectory table at the
+// start of the trial, and the ball stays on screen until it stops
+bool simulatedPhysics = false;
+PhysicsModel physicsModel;
+TrajectoryTable cueTrajectory;
+const double trajectoryMaxMs = 4000;
+
+// Optional key OcclusionMode: "none" (default), "time", "path" or "occluder" hides part of
+// the fall (OcclusionWindow) for the length given by the factor fOcclusion of the trial, in
+// ms, mm of path or mm of occluder depth, from OcclusionStart past the table edge; the
+// balls fade out and back in over OcclusionFadeMs (the alpha of ballMaterial)
+bool occlusionEnabled = false;
+string occlusionMode = "none";
+OcclusionWindow::Kind occlusionKind = OcclusionWindow::TIME;
+double occlusionStart = 0;
+double occlusion = 0;
+OcclusionSchedule occlusionSchedule;
+
 //Table
 float Tablex1 = -100;
 float Tablex2 = 100; 
 float Tabley1 = -70;
-float TableZ1 = displayDepth- ;
+float TableZ1 = displayDepth-200;
 float TableZ2 = displayDepth-400;
 
 //leg
@@ -315,6 +470,9 @@ GLfloat tableMaterial[] = {1.0, 0.0, 0.0, 1.0};
 GLfloat ballMaterial[] = {1.0, 0.0, 0.0, 1.0};
 GLfloat noiseMaterial[] = {1.0, 0.0, 0.0, 1.0};
 GLfloat lineMaterial[] = {0.0, 0.0, 0.0, 1.0};
+const int tableMaterialId = shaders.addMaterial(tableMaterial);
+const int ballMaterialId = shaders.addMaterial(ballMaterial);
+const int lineMaterialId = shaders.addMaterial(lineMaterial);
 GLfloat shininessMaterial = 32.0f;
 // To use the motors:
 // 0. homeEverything(arm speed, screen speed) brings all motors to their start positions, nearest to the mirror.
@@ -339,58 +497,201 @@ void drawFingers();
 void drawStimulus();
 void drawResponseGrid();
 void handleKeypress(unsigned char k, int x, int y);
+void keyboardEvent(unsigned char k, int x, int y);
+void keyboardUpEvent(unsigned char k, int x, int y);
+void handleKeyRelease(unsigned char k);
+void moveProbe(double displacement);
+void processInput();
 void handleResize(int w, int h);
 void idle();
-void initMotors();
-void initOptotrak();
+void initHardware(int argc, char *argv[]);
+bool initMotors();
+bool initOptotrak();
+bool initDisplay(int *argc, char *argv[]);
+bool initInput();
+void scheduledFrame();
 void initProjectionScreen(double _focalDist, const Affine3d &_transformation=Affine3d::Identity(),bool synchronous=true);
 void initRendering();
-void initStreams();
+bool initSubject();
+bool initStreams();
 void initTrial();
-void initVariables();
+void resetTrialState();
+bool initVariables();
+void initRandomStreams(unsigned int seed);
+void randomizeTrial();
+void initExtraBalls();
+void computeCueTrajectory();
+void followCueTrajectory();
+void updateCueVisibility();
+void resumeSession();
 void update(int value);
 void updateTheMarkers();
+void writeFrameProfile();
 
 // online operations
 void online_apparatus_alignment();
 void online_fingers();
 void online_trial();
 
+// offline replay
+bool initOfflineRendering(int *argc, char *argv[], const char *title);
+void renderOfflineFrame(vector<unsigned char> *pixels, double *renderMs);
+void replayTrialFile(const string &trialFileName, const string &outputDirectory);
+void renderReplayFrame(const string &outputDirectory, int frame);
+void writePPM(const string &fileName, int width, int height, const vector<unsigned char> &pixels);
+bool readPPM(const string &fileName, int &width, int &height, vector<unsigned char> &pixels);
+
+// golden frames
+int goldenFrames(const string &referenceDirectory, bool record, int tolerance);
+void startGoldenTrial(int index);
+int renderGoldenFrame(const string &referenceDirectory, const string &name, bool record, int tolerance, ofstream &report);
+
+// tracking benchmark
+void benchmarkTracker(const SyntheticMarkerConfig &config, double seconds, double pollMs);
+
+/*************************** REPLAY ***************************************/
+// Set by "--replay <outputDir> <trialFile> [trialFile ...]": trials are rebuilt from the
+// recorded files and rendered as fast as possible, without Optotrak and motors
+bool replayMode = false;
+bool replaySaveFrames = true;
+double replayIOD = 62;
+const int replayMaxFrames = 2000;
+
+// "--golden record|check <referenceDir> [tolerance]": canonical frames of fixed trials,
+// rendered like the replay and compared against stored references
+struct GoldenTrial
+{
+	float gravity;
+	double speed;
+	float probePos;
+};
+const GoldenTrial goldenTrials[] = { {9.81f, 6.8, -525}, {24.79f, 13.6, -560} };
+const int goldenTrialsCount = sizeof(goldenTrials)/sizeof(goldenTrials[0]);
+const unsigned int goldenSeed = 1;		// fixes the noise masks
+const double goldenMaxMismatch = 0.001;	// fraction of pixels allowed over the tolerance
+
 /*************************** EXPERIMENT SPECS ****************************/
 // experiment directory
 string experiment_directory = "R:/CLPS_Domini_Lab/abdul/fall18-GravityCNTRL/";
 // parameters file directory and name
 string parametersFile_directory = experiment_directory + "fall18-GravityEXP1Parameters.txt";
 // trial file headers
-string trialFile_headers = "subjName\ttrialN\tGravity\tspeed\telapsed\tframeN\tcueBallFalls\ttimeOfFall\tframeOfFall\ttimeOfImpact\tlastFrame\tprobePos\tballPos_y\tballPos_z\timpact_z"; 
+string trialFile_headers = "subjName\ttrialN\tGravity\tspeed\telapsed\tframeN\tcueBallFalls\ttimeOfFall\tframeOfFall\ttimeOfImpact\tlastFrame\tprobePos\tballPos_y\tballPos_z\timpact_z\tprobeOnsetMs\tfirstKeyRTMs\tresponseRTMs\tfeedbackLatencyMs\tframeMs\tphysics\tairDrag\trestitution\trollingFriction\tphysicsStepMs\tocclusionMode\tocclusionStart\tOcclusion\tocclusionFadeMs\textraBalls\textraBallSpacing\textraBallSpeedJitter\tseed"; 
+string headFile_headers = "subjName\ttrialN\theadTracking\tframes\tmeasured\tbridged\tlost\tmeanLatencyMs\tmaxLatencyMs\terrorRMS\terrorMax";
+string framesFile_headers = "subjName\ttrialN\tframes\tframeMs\tframeP99Ms\tlateFrames\tcpuDrawMs\tcpuDrawMaxMs\tgpuFrames\tgpuDropped\tgpuSurfacesMs\tgpuCueBallMs\tgpuProbeMs\tgpuInfoMs\tgpuFrameMs\tgpuFrameP99Ms\tgpuFrameMaxMs";
+string latencyFile_headers = "subjName\tseed\ttrials\tkeys\tmeanLatencyMs\tmedianLatencyMs\tp95LatencyMs\tmaxLatencyMs";
+string fingersFile_headers = "subjName\ttrialN\tprediction\tframes\tmeasured\tbridged\tlost\tmeanLagMs\tmaxLagMs\terrorRMS\terrorMax";
 /*************************** FUNCTIONS ***********************************/
 // First, make sure the filenames in here are correct and that the folders exist.
 // If you mess this up, data may not be recorded!
-void initStreams()
+// Loads the parameters and checks the subject: an existing subject file is only accepted
+// if its session was interrupted. Runs before the startup steps, so that nothing has
+// moved yet when it refuses the subject.
+bool initSubject()
 {
 	ifstream parametersFile;
 	parametersFile.open(parametersFile_directory.c_str());
 	parameters.loadParameterFile(parametersFile);
 
 	string subjectName = parameters.find("SubjectName");
-	
-	// trialFile directory
 	string dirName  = experiment_directory + subjectName;
-	mkdir(dirName.c_str()); // windows syntax
+	makeDirectory(dirName);
 
+	checkpointFileName = dirName + "/" + subjectName + "_checkpoint.txt";
 	if (util::fileExists(dirName+"/"+subjectName + ".txt"))
 	{
-		string error_on_file_io = dirName+"/"+subjectName+".txt" + string(" already exists");
-		cerr << error_on_file_io << endl;
-		MessageBox(NULL, (LPCSTR)"FILE ALREADY EXISTS\n Please check the parameters file.",NULL, NULL);
-		exit(0);
+		if (checkpoint.load(checkpointFileName) && !checkpoint.finished)
+		{
+			resuming = true;
+			cerr << "Resuming " << subjectName << " after trial " << checkpoint.trials << endl;
+		}
+		else
+		{
+			string error_on_file_io = dirName+"/"+subjectName+".txt" + string(" already exists");
+			cerr << error_on_file_io << endl;
+#ifdef _WIN32
+			MessageBox(NULL, (LPCSTR)"FILE ALREADY EXISTS\n Please check the parameters file.",NULL, NULL);
+#endif
+			return false;
+		}
+	}
+	return true;
+}
+
+bool initStreams()
+{
+	string subjectName = parameters.find("SubjectName");
+
+	// optional keys
+	map<string,string> optionalParameters = readParameterLines(parametersFile_directory);
+	headTracking = findParameter<int>(optionalParameters, "HeadTracking", 0) != 0;
+	predictFingers = findParameter<int>(optionalParameters, "FingerPrediction", 0) != 0;
+	predictionLeadMs = findParameter<double>(optionalParameters, "PredictionLeadMs", 18.0);
+	indexPredictor = MotionPredictor(findParameter<double>(optionalParameters, "PredictionProcessNoise", 1E7), 0.2,
+		findParameter<double>(optionalParameters, "PredictionMaxOcclusionMs", 100.0));
+	continuousProbe = findParameter(optionalParameters, "ProbeAdjustment", "steps") == "continuous";
+	probeAdjuster = HoldAdjuster(findParameter<double>(optionalParameters, "ProbeStep", 1.0),
+		findParameter<double>(optionalParameters, "ProbeHoldDelayMs", 150.0),
+		findParameter<double>(optionalParameters, "ProbeMinSpeed", 20.0),
+		findParameter<double>(optionalParameters, "ProbeMaxSpeed", 200.0),
+		findParameter<double>(optionalParameters, "ProbeAcceleration", 400.0));
+	extraBallCount = findParameter<int>(optionalParameters, "ExtraBalls", 0);
+	extraBallSpacing = findParameter<double>(optionalParameters, "ExtraBallSpacing", 20.0);
+	extraBallSpeedJitter = findParameter<double>(optionalParameters, "ExtraBallSpeedJitter", 0.2);
+	simulatedPhysics = findParameter(optionalParameters, "BallPhysics", "ballistic") == "simulated";
+	physicsModel = PhysicsModel(9.81, findParameter<double>(optionalParameters, "AirDrag", 0.0),
+		findParameter<double>(optionalParameters, "Restitution", 0.0),
+		findParameter<double>(optionalParameters, "RollingFriction", 0.5),
+		findParameter<double>(optionalParameters, "PhysicsStepMs", 0.25));
+	if (!(physicsModel.stepMs > 0))
+	{
+		cerr << "PhysicsStepMs must be positive, not " << physicsModel.stepMs << endl;
+		return false;
+	}
+	occlusionMode = findParameter(optionalParameters, "OcclusionMode", "none");
+	occlusionEnabled = OcclusionWindow::parseKind(occlusionMode, occlusionKind);
+	occlusionStart = findParameter<double>(optionalParameters, "OcclusionStart", 0.0);
+	occlusionSchedule.setFadeMs(findParameter<double>(optionalParameters, "OcclusionFadeMs", 0.0));
+	
+	// trialFile directory
+	string dirName  = experiment_directory + subjectName;
+
+	// A new session takes its seed from the parameters file or the clock, a resumed one
+	// reuses the seed of the checkpoint. Every random stream derives from this seed.
+	if (!resuming){
+		checkpoint.seed = findParameter<unsigned int>(optionalParameters, "Seed", 0);
+		if (checkpoint.seed == 0)
+			checkpoint.seed = (unsigned int)time(NULL);
 	}
+	initRandomStreams(checkpoint.seed);
 
 	globalTimer.start();
 
 	string trialFileName = dirName + "/" + subjectName + ".txt";
-	trialFile.open(trialFileName.c_str());
-	trialFile << fixed << trialFile_headers << endl;
+	string fingersFileName = dirName + "/" + subjectName + "_fingers.txt";
+	string headFileName = dirName + "/" + subjectName + "_head.txt";
+	string latencyFileName = dirName + "/" + subjectName + "_latency.txt";
+	string framesFileName = dirName + "/" + subjectName + "_frames.txt";
+	if (resuming){
+		trialFile.open(trialFileName.c_str(), ios::app);
+		fingersFile.open(fingersFileName.c_str(), ios::app);
+		headFile.open(headFileName.c_str(), ios::app);
+		latencyFile.open(latencyFileName.c_str(), ios::app);
+		framesFile.open(framesFileName.c_str(), ios::app);
+	}
+	else{
+		trialFile.open(trialFileName.c_str());
+		trialFile << fixed << trialFile_headers << endl;
+		fingersFile.open(fingersFileName.c_str());
+		fingersFile << fingersFile_headers << endl;
+		headFile.open(headFileName.c_str());
+		headFile << headFile_headers << endl;
+		latencyFile.open(latencyFileName.c_str());
+		latencyFile << latencyFile_headers << endl;
+		framesFile.open(framesFileName.c_str());
+		framesFile << framesFile_headers << endl;
+	}
+	return true;
 }
 
 // Edit case 'f' to establish calibration procedure
@@ -426,19 +727,30 @@ void handleKeypress(unsigned char key, int x, int y){
 			if(trialFile.is_open()){
 				trialFile.close();
 			}
-			homeEverything(5000,4500);
+			motors->homeEverything(5000,4500);
 			cleanup();
 			exit(0);
 		}
 		break;
 		
+		case 'h':
+		case 'H':
+		{
+			// sit in the reference position first, again after changing the IOD
+			if (acquisition && acquisition->calibrate(Vector3d(-interoculardistance/2,0,0), Vector3d(interoculardistance/2,0,0)))
+				beepOk(0);
+			else
+				beepOk(3);
+		}
+		break;
+
 		case 'f':
 		case 'F':
 		{
 				// calibration on the X
 				indexCalibrationPoint=markers.at(ind0).p;
 				indexCalibrationPoint[0] = indexCalibrationPoint[0] - 25;
-				indexCoords.init(indexCalibrationPoint, markers.at(ind1).p, markers.at(ind2).p, markers.at(ind3).p );
+				handSolver.init(indexBody, indexCalibrationPoint, markers);
 
 				fingerCalibrationDone=3;
 				fingersCalibrated=true;
@@ -454,8 +766,13 @@ void handleKeypress(unsigned char key, int x, int y){
 
 		case '8': // higher gravity
 		{
-			if (probePos >= TableZ1 + shotRadius*1.5 ){
+			if (continuousProbe){
+				responseTimes.adjust();
+				moveProbe(probeAdjuster.press(-1, trialStartClock + elapsed));
+			}
+			else if (probePos >= TableZ1 + shotRadius*1.5 ){
 		  probePos = probePos - 3;
+		  responseTimes.adjust();
 			
 			}
 			else {
@@ -467,8 +784,13 @@ void handleKeypress(unsigned char key, int x, int y){
 
 		case '2': // lower gravity
 		{
-			if (probePos <= TableZ1 + 170 ){
+			if (continuousProbe){
+				responseTimes.adjust();
+				moveProbe(probeAdjuster.press(1, trialStartClock + elapsed));
+			}
+			else if (probePos <= TableZ1 + 170 ){
 		  probePos = probePos + 3;
+		  responseTimes.adjust();
 			
 			}
 			else {
@@ -483,10 +805,13 @@ void handleKeypress(unsigned char key, int x, int y){
 			if ((elapsed > timeOfImpact + responseDelay) && cueBallFalls && !(response == 2)){
 				response++;
 				if (response == 2){
-					advanceTrial();
+					// feedback first, so that writing the files does not delay it
+					responseTimes.respond();
 					beepOk(19);
+					advanceTrial();
 				}
 				else { 
+					responseTimes.adjust();
 					beepOk(17);
 				}
 			}
@@ -497,6 +822,66 @@ void handleKeypress(unsigned char key, int x, int y){
 	}
 }
 
+// GLUT keyboard callback: only queues the key with the time it was dispatched
+void keyboardEvent(unsigned char key, int x, int y)
+{
+	if (!inputThread || !inputThread->watches(key))
+		inputQueue.push(key, hardwareClock());
+}
+
+// GLUT key release callback, registered only for the continuous probe adjustment
+void keyboardUpEvent(unsigned char key, int x, int y)
+{
+	if (!inputThread || !inputThread->watches(key))
+		inputQueue.push(key, hardwareClock(), false);
+}
+
+void handleKeyRelease(unsigned char key)
+{
+	if (key == '8')
+		probeAdjuster.release(-1, trialStartClock + elapsed);
+	else if (key == '2')
+		probeAdjuster.release(1, trialStartClock + elapsed);
+}
+
+// Moves the probe within its range, a held key is dropped at the ends of the range
+void moveProbe(double displacement)
+{
+	float nearest = TableZ1 + 170, farthest = TableZ1 + shotRadius*1.5;
+	if (displacement == 0)
+		return;
+	probePos += displacement;
+	if (probePos < farthest || probePos > nearest)
+	{
+		probePos = max(farthest, min(nearest, probePos));
+		probeAdjuster.stop();
+		beepOk(3);
+	}
+}
+
+// Handles the queued key presses; while handling one, elapsed is the time of the press
+// in the current trial, so the responses are logged with the time they were given.
+// A held probe key moves the probe up to each event and then up to now.
+void processInput()
+{
+	InputEvent event;
+	while (inputQueue.pop(event))
+	{
+		elapsed = event.time - trialStartClock;
+		moveProbe(probeAdjuster.update(event.time));
+		if (!event.pressed)
+		{
+			handleKeyRelease(event.key);
+			continue;
+		}
+		responseTimes.key(event.time);
+		handleKeypress(event.key, 0, 0);
+		responseTimes.keyHandled();
+	}
+	elapsed = timer.getElapsedTimeInMilliSec();
+	moveProbe(probeAdjuster.update(hardwareClock()));
+}
+
 /*** GRASP ***/
 void calibration_fingers(int phase)
 {
@@ -567,6 +952,7 @@ void drawInfo()
 			text.draw("#");
 			text.draw("# Name: " +parameters.find("SubjectName"));
 			text.draw("# IOD: " +stringify<double>(interoculardistance));
+			text.draw("# Seed: " +stringify<unsigned int>(checkpoint.seed));
 			text.draw("# Finger to Cue Distance: " +stringify<double>(distanceToCueBall));
 			text.draw("# Gravity: " +stringify<float>(Gravity));
 			text.draw("# Horizontal Velocity:" +stringify<double>(speed));
@@ -683,27 +1069,41 @@ void drawGLScene()
 {
 	online_apparatus_alignment();
 	online_fingers();
+	// the eyes follow the head once 'h' has calibrated, the static ones set in idle() stay
+	// whenever the head is lost
+	if (headTracking && acquisition)
+		headEyes.update(*acquisition, hardwareClock() + predictionLeadMs, eyeLeft, eyeRight);
 	online_trial();
 
+	double drawStart = hardwareClock();
+	gpuProfiler.beginFrame();
 	if (stereo)
-    {   glDrawBuffer(GL_BACK);
-		// Draw left eye view
-        glDrawBuffer(GL_BACK_LEFT);
+    {   // Draw left eye view
+        renderBackend->beginEye(LEFT_EYE);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glClearColor(0.0,0.0,0.0,1.0);
         cam.setEye(eyeLeft);
+        shaders.beginEye(eyeLeft);
+        gpuProfiler.start();
         drawStimulus();
 		drawInfo();
+        gpuProfiler.stamp(gpuInfo);
 
         // Draw right eye view
-        glDrawBuffer(GL_BACK_RIGHT);
+        renderBackend->beginEye(RIGHT_EYE);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glClearColor(0.0,0.0,0.0,0.0);
         cam.setEye(eyeRight);
+        shaders.beginEye(eyeRight);
+        gpuProfiler.start();
         drawStimulus();
 		drawInfo();
+        gpuProfiler.stamp(gpuInfo);
 
-        glutSwapBuffers();
+        trialDraw.add(hardwareClock() - drawStart);
+        renderBackend->swap();
+        gpuProfiler.endFrame();
+        frameScheduler.frameShown(&trialFrames);
     }
     else
     {   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -711,9 +1111,15 @@ void drawGLScene()
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
         cam.setEye(eyeRight);
+        shaders.beginEye(eyeRight);
+        gpuProfiler.start();
         drawStimulus();
 		drawInfo();
-        glutSwapBuffers();
+        gpuProfiler.stamp(gpuInfo);
+        trialDraw.add(hardwareClock() - drawStart);
+        renderBackend->swap();
+        gpuProfiler.endFrame();
+        frameScheduler.frameShown(&trialFrames);
     }
 }
 
@@ -722,6 +1128,7 @@ void drawStimulus()
 {
 	
 	//1. Draw Table Surface 
+	shaders.useMaterial(tableMaterialId);
 	glBegin(GL_QUADS);
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, tableMaterial);
 	glVertex3f(Tablex1, Tabley1,TableZ1); // vertex 1
@@ -747,11 +1154,17 @@ void drawStimulus()
 	glVertex3f(Floorx2, Floory1,Floorz2); // vertex 3
 	glVertex3f(Floorx1, Floory1,Floorz2); // vertex 4
 	glEnd();
+	gpuProfiler.stamp(gpuSurfaces);
 	
 	
-	// 4. Draw target ball
-	if(!floorTouch){
+	// 4. Draw target ball, hidden or faded by the occlusion windows
+	if(!floorTouch && ballMaterial[3] > 0){
 	
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (shaders.isAvailable())
+		shaders.drawSphere(Vector3d(cueCenter_x,cueCenter_y,cueCenter_z), cueRadius, ballMaterialId);
+	else
+	{
 	glPushMatrix();
 	glLoadIdentity();
 	GLUquadricObj* cueBall = gluNewQuadric();
@@ -761,7 +1174,29 @@ void drawStimulus()
 	gluSphere(cueBall, cueRadius, 64, 64);
 	gluDeleteQuadric(cueBall);
 	glPopMatrix();
+	}
+
+	// the other balls of the trial, in a single draw through the shaders
+	if (shaders.isAvailable())
+		shaders.drawSpheres(extraBalls.getSpheres(), extraBalls.size(), ballMaterialId);
+	else if (extraBalls.size() > 0)
+	{
+		GLUquadricObj* extraBall = gluNewQuadric();
+		gluQuadricDrawStyle(extraBall, GLU_FILL);
+		glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, ballMaterial);
+		for (int i = 0; i < extraBalls.size(); i++)
+		{
+			Vector3d center = extraBalls.getPosition(i);
+			glPushMatrix();
+			glLoadIdentity();
+			glTranslated(center.x(), center.y(), center.z());
+			gluSphere(extraBall, extraBalls.getRadius(i), 64, 64);
+			glPopMatrix();
 		}
+		gluDeleteQuadric(extraBall);
+	}
+		}
+	gpuProfiler.stamp(gpuCueBall);
 
 	/*5. Draw noise
 	 glBegin(GL_QUADS);
@@ -784,10 +1219,15 @@ void drawStimulus()
 	}*/
 
 	
-	if((elapsed > lastFrame + responseDelay) && floorTouch){//  after display period
+	if((elapsed > timeOfImpact + responseDelay) && floorTouch){//  after display period, as the '+' key
 	
 	// 5. Draw response point
+		responseTimes.stimulusOnset(hardwareClock());
 		
+		if (shaders.isAvailable())
+			shaders.drawSphere(Vector3d(cueCenter_x,-137.83,probePos), 2, lineMaterialId);
+		else
+		{
 		glPushMatrix();
 		glLoadIdentity();
 		GLUquadricObj* qobj = gluNewQuadric();
@@ -797,7 +1237,10 @@ void drawStimulus()
 		gluSphere(qobj, 2, 6, 6);
 		gluDeleteQuadric(qobj);
 		glPopMatrix();
+		}
 	}
+	gpuProfiler.stamp(gpuProbe);
+	shaders.end();
 	/*glPushMatrix();
 	glLoadIdentity();
 	GLUquadricObj* shotGlass = gluNewQuadric();
@@ -856,7 +1299,8 @@ void build_masks()
 	for (int xpos=0-(numTilesX/2); xpos<(numTilesX/2); xpos++){
 		for (int ypos=0-(numTilesY/2); ypos<(numTilesY/2); ypos++){
 
-			double randNum = unifRand(0,2);
+			// indexed by trial and tile, so tiles can be generated in any order or in parallel
+			double randNum = 2*maskStream.uniformAt((boost::uint64_t)trialNumber*numTiles + tileNum);
 			if (randNum>2)
 				mask2_colors[tileNum] = 1.0;
 			if (randNum>1.0 && randNum<=2.0)
@@ -877,8 +1321,33 @@ void build_masks()
 // called at the beginning of every trial
 void initTrial()
 {
-	// initializing all variables
+	resetTrialState();
+	randomizeTrial();
+
+	Gravity = trial.getCurrent()["Gravity"];
+	speed = trial.getCurrent()["Speed"];
+	occlusion = occlusionEnabled ? trial.getCurrent()["Occlusion"] : 0;
+	
+	initProjectionScreen(displayDepth);
+	
+	// roll on
+	drawGLScene();
+	timer.start();
+	trialStartClock = hardwareClock();
+}
+
+// initializing all variables, shared by initTrial() and the replay
+void resetTrialState()
+{
 	frameN=0;
+	indexMetrics.reset();
+	headEyes.resetMetrics();
+	responseTimes.reset();
+	extraBalls.clear();
+	trialFrames.reset();
+	trialDraw.reset();
+	gpuProfiler.reset();
+	probeAdjuster.stop();
 	cueVelSet = false;
 	cueBallFalls = false;
 	floorTouch = false;
@@ -886,24 +1355,32 @@ void initTrial()
 	timeOfFall = 0;
 	ballPos_y = 0;
 	ballPos_z = 0;
-	probePos = probePos = -1*(rand()% 150+450); 
 	response = 0;
 	ballMaterial[3] = 1;
 	dist = 0;
-	build_masks();
-
-	Gravity = trial.getCurrent()["Gravity"];
-	speed = trial.getCurrent()["Speed"];
 	cueCenter_x = 0;
 	cueCenter_y = -62;
 	cueCenter_z = ballStartPos_z; 
-	
-	
-	initProjectionScreen(displayDepth);
-	
-	// roll on
-	drawGLScene();
-	timer.start();
+}
+
+// One independent stream per subsystem, all derived from the session seed.
+// BalanceFactor shuffles with rand(), which gets its seed from the schedule stream.
+void initRandomStreams(unsigned int seed)
+{
+	scheduleStream = RandomStream(seed, RNG_SCHEDULE);
+	probeStream = RandomStream(seed, RNG_PROBE);
+	maskStream = RandomStream(seed, RNG_MASKS);
+	ballStream = RandomStream(seed, RNG_BALLS);
+	srand((unsigned int)scheduleStream.next());
+	cerr << "Random seed: " << seed << endl;
+}
+
+// Every random draw of a trial goes here. Draws are indexed by the trial number, so they
+// do not depend on what happened in the previous trials.
+void randomizeTrial()
+{
+	probePos = -1*(probeStream.uniformIntAt(trialNumber, 150)+450); 
+	build_masks();
 }
 
 // This function handles the transition from the end of one trial to the beginning of the next.
@@ -924,7 +1401,41 @@ void advanceTrial() {
 	probePos << "\t" <<
 	ballPos_y << "\t" <<
 	ballPos_z << "\t" <<
-	impact_z << endl;
+	impact_z << "\t" <<
+	responseTimes.getOnset(trialStartClock) << "\t" <<
+	responseTimes.getFirstKeyTime() << "\t" <<
+	responseTimes.getReactionTime() << "\t" <<
+	responseTimes.getFeedbackLatency() << "\t" <<
+	frameDurationMs << "\t" <<
+	simulatedPhysics << "\t" <<
+	physicsModel.airDrag << "\t" <<
+	physicsModel.restitution << "\t" <<
+	physicsModel.rollingFriction << "\t" <<
+	physicsModel.stepMs << "\t" <<
+	occlusionMode << "\t" <<
+	occlusionStart << "\t" <<
+	occlusion << "\t" <<
+	occlusionSchedule.getFadeMs() << "\t" <<
+	extraBallCount << "\t" <<
+	extraBallSpacing << "\t" <<
+	extraBallSpeedJitter << "\t" <<
+	checkpoint.seed << endl;
+	fingersFile << fixed <<
+	parameters.find("SubjectName") << "\t" <<
+	trialNumber << "\t" <<
+	predictFingers << "\t" <<
+	indexMetrics.frames << "\t" <<
+	indexMetrics.measured << "\t" <<
+	indexMetrics.bridged << "\t" <<
+	indexMetrics.lost << "\t" <<
+	indexMetrics.getMeanLag() << "\t" <<
+	indexMetrics.getMaxLag() << "\t" <<
+	indexMetrics.getErrorRMS() << "\t" <<
+	indexMetrics.getMaxError() << endl;
+	headEyes.writeTrial(headFile, parameters.find("SubjectName"), trialNumber, headTracking);
+	writeFrameProfile();
+	checkpoint.responses.push_back(probePos);
+	checkpoint.trials = (int)checkpoint.responses.size();
 
 	//if(trialFile.is_open())
 	//	trialFile.close();
@@ -935,13 +1446,20 @@ void advanceTrial() {
 		initTrial();
 	}else{
 		trialFile.close();
+		fingersFile.close();
+		headFile.close();
+		framesFile.close();
 		finished=true;
 	}
+
+	checkpoint.finished = finished;
+	checkpoint.save(checkpointFileName);
 }
 
 void idle() {
 
 	elapsed = timer.getElapsedTimeInMilliSec();
+	processInput();
 
 	// get new marker positions from optotrak
 	updateTheMarkers();
@@ -1010,6 +1528,30 @@ void online_apparatus_alignment()
 	}
 }
 
+// CPU frame times of the trial and the GPU time of each drawing phase, mean over frames
+void writeFrameProfile()
+{
+	framesFile << fixed <<
+	parameters.find("SubjectName") << "\t" <<
+	trialNumber << "\t" <<
+	trialFrames.getCount() << "\t" <<
+	trialFrames.getMean() << "\t" <<
+	trialFrames.getPercentile(99) << "\t" <<
+	trialFrames.countOver(frameDurationMs*1.5) << "\t" <<
+	trialDraw.getMean() << "\t" <<
+	trialDraw.getMax() << "\t" <<
+	gpuProfiler.getTotal().getCount() << "\t" <<
+	gpuProfiler.getDroppedFrames();
+	// -1 without timer queries
+	bool gpu = gpuProfiler.isAvailable();
+	for (int phase = 0; phase < gpuProfiler.getPhaseCount(); phase++)
+		framesFile << "\t" << (gpu ? gpuProfiler.getPhase(phase).getMean() : -1);
+	framesFile << "\t" <<
+	(gpu ? gpuProfiler.getTotal().getMean() : -1) << "\t" <<
+	(gpu ? gpuProfiler.getTotal().getPercentile(99) : -1) << "\t" <<
+	(gpu ? gpuProfiler.getTotal().getMax() : -1) << endl;
+}
+
 void online_fingers()
 {
 	// Visibility check
@@ -1017,23 +1559,32 @@ void online_fingers()
 	//allVisibleThumb = isVisible(markers.at(thu1).p) && isVisible(markers.at(thu2).p) && isVisible(markers.at(thu3).p);
 	allVisibleFingers = allVisibleIndex;
 
-	// fingers coordinates, fingersOccluded and framesOccluded
-	if ( allVisibleFingers )
-	{
-		indexCoords.update(markers.at(ind1).p, markers.at(ind2).p, markers.at(ind3).p );
-		//thumbCoords.update(markers.at(thu1).p, markers.at(thu2).p, markers.at(thu3).p );
-		//indexJointCoords.update(markers.at(ind1).p, markers.at(ind2).p, markers.at(ind3).p );
-		//thumbJointCoords.update(markers.at(thu1).p, markers.at(thu2).p, markers.at(thu3).p );
-	}
+	// fingers coordinates, every body in one pass; occluded bodies keep their last position
+	handSolver.solve(markers);
 
 	if(fingersCalibrated)
 	{
 		// index coordinates
 		if(allVisibleIndex){
-			ind = indexCoords.getP1();
+			ind = handSolver.getPoint(indexBody);
 			//if(fingerCalibrationDone>=3)
 			//	indJoint = indexJointCoords.getP1();
 		}
+
+		// the filter sees each tracker frame once, then extrapolates the index to the time
+		// this frame will be shown, also across occlusions up to PredictionMaxOcclusionMs
+		bool newSample = allVisibleIndex && markersTime != lastFingerSample;
+		if(newSample){
+			lastFingerSample = markersTime;
+			indexPredictor.correct(ind, lastFingerSample);
+			indexMetrics.sample(ind, lastFingerSample);
+		}
+		double displayTime = hardwareClock() + predictionLeadMs;
+		bool tracking = indexPredictor.isTracking(displayTime);
+		Vector3d predicted = indexPredictor.predict(displayTime);
+		indexMetrics.frame(displayTime, indexPredictor.getLastMeasurementTime(), predicted, newSample, tracking);
+		if(predictFingers && tracking)
+			ind = predicted;
 		// thumb coordinates
 		//if(allVisibleThumb){
 			//thm = thumbCoords.getP1();
@@ -1074,6 +1625,17 @@ void online_trial()
 		if(!cueVelSet){
 			timeStart = elapsed;
 			cueVelSet = true;
+			initExtraBalls();
+			if (simulatedPhysics || occlusionEnabled)
+				computeCueTrajectory();
+		}
+		if (simulatedPhysics)
+		{
+			followCueTrajectory();
+			frameN++;
+			extraBalls.update(frameN*frameDurationMs);
+			updateCueVisibility();
+			return;
 		}
 		//Check for contact with table surface
 		if(!cueBallFalls){
@@ -1110,12 +1672,12 @@ void online_trial()
 		// update ball positions 
 		if(cueBallFalls && !floorTouch){
 			double oldY = cueCenter_y;
-			cueCenter_z += speed;
-			cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(11.76*(frameN-frameOfFall+1), 2); //starts at 
+			cueCenter_z += speed*frameDurationMs/referenceFrameMs;
+			cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(frameDurationMs*(frameN-frameOfFall+1), 2); //starts at 
 			if (cueCenter_y <= -129.83)
 			{
 				cueCenter_y = -129.83;
-				cueCenter_z = (speed/11.76)* sqrt(75*(2000/Gravity)) -600;
+				cueCenter_z = (speed/referenceFrameMs)* sqrt(75*(2000/Gravity)) -600;
 			}
 			/*if (frameN > frameOfFall + 9){ //ONLY SHOWS LAST 3 FRAMES
 
@@ -1126,14 +1688,488 @@ void online_trial()
 			
 		}
 		if (!cueBallFalls){
-			cueCenter_z += speed;
+			cueCenter_z += speed*frameDurationMs/referenceFrameMs;
 			cueCenter_y += 0;
 		}
 		// Advance frame number
 		frameN++;
+		extraBalls.update(frameN*frameDurationMs);
+		updateCueVisibility();
 	}	
 }
 
+// Integrated for the Gravity and speed of the trial from the start position of the cue ball;
+// the ball falls from the same table edge and lands at the same floor height as the parabola
+// With the ballistic model the table only serves the occlusion windows; it follows the
+// parabola to the floor.
+void computeCueTrajectory()
+{
+	PhysicsModel model = simulatedPhysics ? physicsModel : PhysicsModel();
+	model.gravity = Gravity;
+	cueTrajectory.compute(model, Vector3d(cueCenter_x, cueCenter_y, cueCenter_z), Vector3d(0, 0, speed/referenceFrameMs),
+		TableZ1 + 0.3*cueRadius, Floory1 + cueRadius, trajectoryMaxMs);
+	if (simulatedPhysics)
+		impact_z = cueTrajectory.getImpactTime() < 0 ? -1 : cueTrajectory.getImpactPosition().z();
+	if (occlusionEnabled)
+		occlusionSchedule.build(vector<OcclusionWindow>(1, OcclusionWindow(occlusionKind, occlusionStart, occlusion)),
+			cueTrajectory, TableZ1 + 0.3*cueRadius);
+}
+
+// After frameN++, for the time the frame shows; without occlusion the ball is always
+// opaque, whatever alpha a previous (replayed) trial left
+void updateCueVisibility()
+{
+	ballMaterial[3] = occlusionEnabled ? (float)occlusionSchedule.visibility(frameN*frameDurationMs) : 1;
+}
+
+// Frame frameN shows the ball where it is at the end of the frame, as the parabola does.
+// The display ends (floorTouch) when the ball stops or the table runs out.
+void followCueTrajectory()
+{
+	double t = (frameN + 1)*frameDurationMs;
+	Vector3d position = cueTrajectory.at(t);
+	cueCenter_x = position.x();
+	cueCenter_y = position.y();
+	cueCenter_z = position.z();
+	if (!cueBallFalls && cueTrajectory.getFallTime() >= 0 && t >= cueTrajectory.getFallTime())
+	{
+		frameOfFall = frameN + 1;
+		timeOfFall = elapsed;
+		cueBallFalls = true;
+	}
+	double restTime = cueTrajectory.getRestTime();
+	if ((restTime >= 0 && t >= restTime) || t >= cueTrajectory.getDurationMs())
+	{
+		ballPos_z = cueCenter_z;
+		ballPos_y = cueCenter_y;
+		lastFrame = frameN;
+		timeOfImpact = elapsed;
+		floorTouch = true;
+	}
+}
+
+// The extra balls start level with the cue ball and fall from the same table edge (where
+// online_trial() lets the cue ball fall) to the same floor. Their time is counted in frames
+// like the cue ball, and their speeds are drawn by trial number from the session seed, so
+// the replay rebuilds them from the extraBalls columns and the seed of the trial file.
+void initExtraBalls()
+{
+	extraBalls.clear();
+	int perSide = max(1, (int)((Tablex2 - cueRadius - fabs(cueCenter_x))/extraBallSpacing));
+	for (int i = 0; i < extraBallCount; i++)
+	{
+		int slot = i % (2*perSide), row = i / (2*perSide);
+		double x = cueCenter_x + (slot % 2 ? -1 : 1)*extraBallSpacing*(slot/2 + 1);
+		double z = cueCenter_z - row*extraBallSpacing;
+		double scale = 1 + extraBallSpeedJitter*(2*ballStream.uniformAt((boost::uint64_t)trialNumber*extraBallCount + i) - 1);
+		extraBalls.add(Vector3d(x, cueCenter_y, z), 0, speed*scale/referenceFrameMs, cueRadius,
+			TableZ1 + 0.3*cueRadius, Floory1 + cueRadius, Gravity);
+	}
+	extraBalls.update(frameN*frameDurationMs);
+}
+
+/*** Offline replay ***/
+// Offscreen buffers (a plain window without GRAVITY_OFFSCREEN) instead of the stereo game
+// mode, for the replay and the golden frames
+bool initOfflineRendering(int *argc, char *argv[], const char *title)
+{
+	replayMode = true;
+#ifdef GRAVITY_OFFSCREEN
+	renderBackend = openBackend(new EGLOffscreenBackend(), argc, argv, SCREEN_WIDTH, SCREEN_HEIGHT);
+#else
+	renderBackend = openBackend(new GlutWindowBackend(title), argc, argv, SCREEN_WIDTH, SCREEN_HEIGHT);
+#endif
+	if (!renderBackend)
+		return false;
+	initRendering();
+	return true;
+}
+
+// Draws both eyes of the current frame and swaps. With pixels, each eye is read back into
+// pixels[eye]; with renderMs, each eye is timed up to glFinish() into renderMs[eye].
+void renderOfflineFrame(vector<unsigned char> *pixels, double *renderMs)
+{
+	for (int eye = LEFT_EYE; eye <= RIGHT_EYE; eye++)
+	{
+		Timer renderTimer;
+		renderTimer.start();
+		renderBackend->beginEye((Eye)eye);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		cam.setEye(eye == LEFT_EYE ? eyeLeft : eyeRight);
+		shaders.beginEye(eye == LEFT_EYE ? eyeLeft : eyeRight);
+		drawStimulus();
+		if (renderMs)
+		{
+			glFinish();
+			renderMs[eye] = renderTimer.getElapsedTimeInMilliSec();
+		}
+		if (pixels)
+			renderBackend->readEye(pixels[eye]);
+	}
+	renderBackend->swap();
+}
+
+// Rebuilds every trial of a recorded trial file with online_trial() itself, renders both eyes
+// frame by frame and writes them as PPM images, together with replay.txt comparing the
+// replayed frameOfFall, lastFrame and ballPos_z to the recorded ones.
+// Frames are stepped at the frameMs of the recording (the nominal 11.76 ms for files without
+// it), with no tracker, motors or vsync. Files without the extraBalls columns replay the cue
+// ball alone.
+void replayTrialFile(const string &trialFileName, const string &outputDirectory)
+{
+	ifstream input(trialFileName.c_str());
+	if (!input.is_open())
+	{
+		cerr << trialFileName << " not found" << endl;
+		return;
+	}
+	makeDirectory(outputDirectory);
+
+	string line;
+	getline(input, line);
+	vector<string> columns;
+	{
+		istringstream header(line);
+		string column;
+		while (getline(header, column, '\t'))
+			columns.push_back(column);
+	}
+
+	ofstream summary((outputDirectory + "/replay.txt").c_str());
+	summary << fixed << "trialN\tGravity\tspeed\tprobePos\tframeOfFall\treplay_frameOfFall\tlastFrame\treplay_lastFrame\tballPos_z\treplay_ballPos_z\tframes" << endl;
+
+	fingersCalibrated = true;
+	visibleInfo = false;
+	eyeRight = Vector3d(replayIOD/2,0,0);
+	eyeLeft = Vector3d(-replayIOD/2,0,0);
+	initProjectionScreen(displayDepth);
+
+	// online_trial() prints every frame to cout, which would be timed with the frames
+	streambuf *console = cout.rdbuf(NULL);
+	Timer replayTimer;
+	replayTimer.start();
+	int totalFrames = 0;
+	while (getline(input, line))
+	{
+		map<string,string> row;
+		istringstream values(line);
+		string value;
+		for (size_t i = 0; i < columns.size() && getline(values, value, '\t'); i++)
+			row[columns[i]] = value;
+		if (row.size() != columns.size())
+			continue;
+
+		trialNumber = str2num<int>(row["trialN"]);
+		finished = false;
+		resetTrialState();
+		Gravity = str2num<float>(row["Gravity"]);
+		speed = str2num<double>(row["speed"]);
+		probePos = str2num<float>(row["probePos"]);
+		frameDurationMs = row.count("frameMs") ? str2num<double>(row["frameMs"]) : referenceFrameMs;
+		simulatedPhysics = row.count("physics") && str2num<int>(row["physics"]) != 0;
+		occlusionEnabled = row.count("occlusionMode") && OcclusionWindow::parseKind(row["occlusionMode"], occlusionKind);
+		if (occlusionEnabled)
+		{
+			occlusionStart = str2num<double>(row["occlusionStart"]);
+			occlusion = str2num<double>(row["Occlusion"]);
+			occlusionSchedule.setFadeMs(str2num<double>(row["occlusionFadeMs"]));
+		}
+		if (simulatedPhysics)
+			physicsModel = PhysicsModel(Gravity, str2num<double>(row["airDrag"]), str2num<double>(row["restitution"]),
+				str2num<double>(row["rollingFriction"]),
+				row.count("physicsStepMs") && str2num<double>(row["physicsStepMs"]) > 0 ? str2num<double>(row["physicsStepMs"]) : physicsModel.stepMs);
+		extraBallCount = row.count("extraBalls") ? str2num<int>(row["extraBalls"]) : 0;
+		if (extraBallCount > 0)
+		{
+			extraBallSpacing = str2num<double>(row["extraBallSpacing"]);
+			extraBallSpeedJitter = str2num<double>(row["extraBallSpeedJitter"]);
+			ballStream = RandomStream(str2num<unsigned int>(row["seed"]), RNG_BALLS);
+		}
+
+		int frames = 0;
+		while (!floorTouch && frameN < replayMaxFrames)
+		{
+			elapsed = frameN*frameDurationMs;
+			online_trial();
+			renderReplayFrame(outputDirectory, frames++);
+		}
+
+		// response phase, with the probe where the subject left it
+		elapsed = max(elapsed, timeOfImpact + responseDelay + 1);
+		renderReplayFrame(outputDirectory, frames++);
+		totalFrames += frames;
+
+		summary << fixed <<
+			trialNumber << "\t" <<
+			Gravity << "\t" <<
+			speed << "\t" <<
+			probePos << "\t" <<
+			row["frameOfFall"] << "\t" <<
+			frameOfFall << "\t" <<
+			row["lastFrame"] << "\t" <<
+			lastFrame << "\t" <<
+			row["ballPos_z"] << "\t" <<
+			ballPos_z << "\t" <<
+			frames << endl;
+	}
+
+	double seconds = replayTimer.getElapsedTimeInMilliSec()/1000.0;
+	cout.rdbuf(console);
+	cout.clear();
+	cout << trialFileName << ": " << totalFrames << " frames in " << seconds << " s (" <<
+		(seconds > 0 ? totalFrames/seconds : 0) << " frames/s, " << (replaySaveFrames ? "saved" : "not saved") << ")" << endl;
+}
+
+// Renders both eyes of the current frame and saves them as trialN_frame_left/right.ppm
+void renderReplayFrame(const string &outputDirectory, int frame)
+{
+	if (!replaySaveFrames)
+	{
+		renderOfflineFrame(NULL, NULL);
+		return;
+	}
+	vector<unsigned char> pixels[2];
+	renderOfflineFrame(pixels, NULL);
+	for (int eye = LEFT_EYE; eye <= RIGHT_EYE; eye++)
+		writePPM(outputDirectory + "/" + stringify<int>(trialNumber) + "_" + stringify<int>(frame) + (eye == LEFT_EYE ? "_left.ppm" : "_right.ppm"),
+			renderBackend->getWidth(), renderBackend->getHeight(), pixels[eye]);
+}
+
+// Binary PPM, rows flipped since OpenGL reads them bottom-up
+void writePPM(const string &fileName, int width, int height, const vector<unsigned char> &pixels)
+{
+	ofstream image(fileName.c_str(), ios::binary);
+	image << "P6\n" << width << " " << height << "\n255\n";
+	for (int y = height-1; y >= 0; y--)
+		image.write((const char*)&pixels[y*width*3], width*3);
+}
+
+// Reads a binary PPM written by writePPM(), rows back in OpenGL order
+bool readPPM(const string &fileName, int &width, int &height, vector<unsigned char> &pixels)
+{
+	ifstream image(fileName.c_str(), ios::binary);
+	string magic;
+	int maxValue = 0;
+	image >> magic >> width >> height >> maxValue;
+	image.get();
+	if (!image || magic != "P6" || maxValue != 255 || width <= 0 || height <= 0)
+		return false;
+	pixels.resize(width*height*3);
+	for (int y = height-1; y >= 0; y--)
+		image.read((char*)&pixels[y*width*3], width*3);
+	return image.good();
+}
+
+/*** Tracking benchmark ***/
+// Feeds a SyntheticTracker into updateTheMarkers() and online_fingers() for the given time,
+// polling every pollMs (0 polls continuously, as glutIdleFunc does). For every new frame
+// in which the index is visible it measures the latency from the generation of the
+// sample to the new ind; the extra hands are added to handSolver, so online_fingers()
+// solves them in the same pass and their cost is included. Results go to
+// trackerBenchmark.txt.
+void benchmarkTracker(const SyntheticMarkerConfig &config, double seconds, double pollMs)
+{
+	SyntheticTracker *synthetic = new SyntheticTracker(config);
+	tracker = synthetic;
+	if (!tracker->init())
+	{
+		cerr << "Invalid synthetic marker configuration" << endl;
+		tracker = NULL;
+		delete synthetic;
+		return;
+	}
+	fingersCalibrated = true;
+
+	// calibrate every hand on its first frame
+	updateTheMarkers();
+	for (size_t h = 0; h < config.bodies.size(); h++)
+	{
+		const vector<int> &body = config.bodies[h];
+		int solverBody = h == 0 ? indexBody : handSolver.addBody(body[0], body[1], body[2]);
+		handSolver.init(solverBody, markers.at(body[0]).p + Vector3d(0,0,-20), markers);
+	}
+
+	vector<double> latencies, processing;
+	boost::uint64_t lastFrame = synthetic->getFrameNumber(), firstFrame = lastFrame, skipped = 0, occluded = 0, polls = 0;
+	double start = hardwareClock();
+	while (hardwareClock() - start < seconds*1000)
+	{
+		double pollStart = hardwareClock();
+		updateTheMarkers();
+		polls++;
+		if (synthetic->getFrameNumber() != lastFrame)
+		{
+			skipped += synthetic->getFrameNumber() - lastFrame - 1;
+			lastFrame = synthetic->getFrameNumber();
+
+			online_fingers();
+			double now = hardwareClock();
+			processing.push_back(now - pollStart);
+			if (allVisibleIndex)
+				latencies.push_back(now - tracker->getSampleTime());
+			else
+				occluded++;
+		}
+		if (pollMs > 0)
+		{
+			double wait = pollStart + pollMs - hardwareClock();
+			if (wait > 0)
+				boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)(wait*1000)));
+		}
+	}
+	tracker->stop();
+
+	boost::uint64_t frames = lastFrame - firstFrame;
+	sort(latencies.begin(), latencies.end());
+	sort(processing.begin(), processing.end());
+	double meanLatency = 0;
+	for (size_t i = 0; i < latencies.size(); i++)
+		meanLatency += latencies[i]/latencies.size();
+	double medianLatency = latencies.empty() ? 0 : latencies[latencies.size()/2];
+	double p99Latency = latencies.empty() ? 0 : latencies[(size_t)(0.99*(latencies.size()-1))];
+	double maxLatency = latencies.empty() ? 0 : latencies.back();
+	double medianProcessing = processing.empty() ? 0 : processing[processing.size()/2];
+
+	ofstream results("trackerBenchmark.txt");
+	results << fixed << setprecision(4) <<
+		"markers\trateHz\thands\tnoiseSD\tocclusionsPerSecond\tpollMs\tframes\tpolls\tskipped\toccluded\tmeanLatencyMs\tmedianLatencyMs\tp99LatencyMs\tmaxLatencyMs\tmedianProcessingMs" << endl;
+	results << config.numMarkers << "\t" << config.rateHz << "\t" << config.bodies.size() << "\t" << config.noiseSD << "\t" <<
+		config.occlusionsPerSecond << "\t" << pollMs << "\t" << frames << "\t" << polls << "\t" << skipped << "\t" << occluded << "\t" <<
+		meanLatency << "\t" << medianLatency << "\t" << p99Latency << "\t" << maxLatency << "\t" << medianProcessing << endl;
+
+	cout << fixed << setprecision(3) << config.numMarkers << " markers at " << config.rateHz << " Hz, " << config.bodies.size() << " hands: " <<
+		frames << " frames, " << skipped << " skipped, " << occluded << " with the index occluded; latency mean " << meanLatency <<
+		" ms, median " << medianLatency << " ms, p99 " << p99Latency << " ms, max " << maxLatency << " ms" << endl;
+
+	tracker = NULL;
+	delete synthetic;
+}
+
+/*** Golden frames ***/
+// Renders four canonical frames of every golden trial (pre-fall, mid-fall, landing and the
+// probe phase), both eyes, and stores them in referenceDirectory (record) or compares them
+// with the ones stored there (check). A pixel mismatches when one of its channels differs
+// by more than the tolerance; a frame fails when more than goldenMaxMismatch of its pixels
+// mismatch. The outcome and the render time of every frame go to golden.txt, and the
+// return value is the number of failed frames.
+int goldenFrames(const string &referenceDirectory, bool record, int tolerance)
+{
+	makeDirectory(referenceDirectory);
+	ofstream report((referenceDirectory + (record ? "/golden_record.txt" : "/golden.txt")).c_str());
+	report << fixed << setprecision(3) << "frame\teye\trenderMs\tmaxDiff\tmismatched\tresult" << endl;
+
+	fingersCalibrated = true;
+	visibleInfo = false;
+	eyeRight = Vector3d(replayIOD/2,0,0);
+	eyeLeft = Vector3d(-replayIOD/2,0,0);
+	initProjectionScreen(displayDepth);
+	initRandomStreams(goldenSeed);
+
+	// without the per-frame output of online_trial()
+	streambuf *console = cout.rdbuf(NULL);
+	int failures = 0;
+	for (int t = 0; t < goldenTrialsCount; t++)
+	{
+		// a first pass finds when the ball leaves the table and when it lands
+		startGoldenTrial(t);
+		while (!floorTouch && frameN < replayMaxFrames)
+		{
+			elapsed = frameN*frameDurationMs;
+			online_trial();
+		}
+		// at lastFrame the ball is already gone, the frame before shows it on the floor
+		const char *phases[] = { "prefall", "midfall", "landing" };
+		int phaseFrames[] = { (int)frameOfFall/2, ((int)frameOfFall + (int)lastFrame)/2, (int)lastFrame - 1 };
+		string prefix = "golden" + stringify<int>(t+1) + "_";
+
+		startGoldenTrial(t);
+		int phase = 0;
+		while (phase < 3 && !floorTouch && frameN < replayMaxFrames)
+		{
+			elapsed = frameN*frameDurationMs;
+			online_trial();
+			// online_trial() has already advanced frameN
+			if (frameN-1 == phaseFrames[phase])
+				failures += renderGoldenFrame(referenceDirectory, prefix + phases[phase++], record, tolerance, report);
+		}
+		for (; phase < 3; phase++)
+		{
+			report << prefix << phases[phase] << "\t-\t-\t-\t-\tnot reached" << endl;
+			failures++;
+		}
+
+		elapsed = max(elapsed, timeOfImpact + responseDelay + 1);
+		failures += renderGoldenFrame(referenceDirectory, prefix + "probe", record, tolerance, report);
+	}
+	cout.rdbuf(console);
+	cout.clear();
+
+	cout << (record ? "Golden frames recorded in " : "Golden frames checked against ") << referenceDirectory <<
+		", " << failures << " failed" << endl;
+	return failures;
+}
+
+void startGoldenTrial(int index)
+{
+	trialNumber = index+1;
+	finished = false;
+	resetTrialState();
+	build_masks();
+	Gravity = goldenTrials[index].gravity;
+	speed = goldenTrials[index].speed;
+	probePos = goldenTrials[index].probePos;
+}
+
+// Renders and times both eyes of the current frame, then stores or checks them
+int renderGoldenFrame(const string &referenceDirectory, const string &name, bool record, int tolerance, ofstream &report)
+{
+	int failures = 0;
+	vector<unsigned char> frame[2], reference;
+	double renderMs[2];
+	renderOfflineFrame(frame, renderMs);
+	for (int eye = LEFT_EYE; eye <= RIGHT_EYE; eye++)
+	{
+		const vector<unsigned char> &pixels = frame[eye];
+		string eyeName = eye == LEFT_EYE ? "left" : "right";
+		string fileName = referenceDirectory + "/" + name + "_" + eyeName + ".ppm";
+		report << name << "\t" << eyeName << "\t" << renderMs[eye] << "\t";
+		if (record)
+		{
+			writePPM(fileName, renderBackend->getWidth(), renderBackend->getHeight(), pixels);
+			report << "-\t-\trecorded" << endl;
+			continue;
+		}
+
+		int width = 0, height = 0;
+		if (!readPPM(fileName, width, height, reference) || width != renderBackend->getWidth() || height != renderBackend->getHeight())
+		{
+			report << "-\t-\tmissing reference" << endl;
+			failures++;
+			continue;
+		}
+
+		int maxDiff = 0, mismatched = 0;
+		for (size_t p = 0; p < pixels.size(); p += 3)
+		{
+			int pixelDiff = 0;
+			for (int c = 0; c < 3; c++)
+				pixelDiff = max(pixelDiff, abs((int)pixels[p+c] - (int)reference[p+c]));
+			maxDiff = max(maxDiff, pixelDiff);
+			if (pixelDiff > tolerance)
+				mismatched++;
+		}
+		bool passed = mismatched <= goldenMaxMismatch*width*height;
+		report << maxDiff << "\t" << mismatched << "\t" << (passed ? "ok" : "FAILED") << endl;
+		if (!passed)
+		{
+			// keep the rendered frame next to the reference for inspection
+			writePPM(referenceDirectory + "/" + name + "_" + eyeName + "_failed.ppm", width, height, pixels);
+			failures++;
+		}
+	}
+	return failures;
+}
+
 	
 
 
@@ -1143,20 +2179,42 @@ void online_trial()
 
 void updateTheMarkers()
 {
-	optotrak.updateMarkers();
-	markers = optotrak.getAllMarkers();
+	if (acquisition && acquisition->isRunning())
+		acquisition->getMarkers(markers, markersTime);
+	else
+	{
+		tracker->update();
+		markers = tracker->getAllMarkers();
+		markersTime = tracker->getSampleTime();
+	}
+	if (recordingMarkers)
+		markerRecorder.write(markersTime, markers);
 }
 
-void initVariables() 
+bool initVariables() 
 {
 	trial.init(parameters);
 	interoculardistance = str2num<double>(parameters.find("IOD"));
+
+	if (resuming)
+		resumeSession();
+	return true;
+}
+
+// Replays the checkpointed trials with the same seed, so that the BalanceFactor
+// continues exactly where the interrupted session stopped.
+// Pressing F afterwards starts the first trial that was not completed.
+void resumeSession()
+{
+	for (size_t i = 0; i < checkpoint.responses.size(); i++)
+		trial.next();
+	trialNumber = checkpoint.trials;
 }
 
 void update(int value)
 {
     glutPostRedisplay();
-    glutTimerFunc(TIMER_MS, update, 0);
+    glutTimerFunc((unsigned int)frameDurationMs, update, 0);
 }
 
 void handleResize(int w, int h)
@@ -1175,10 +2233,12 @@ void initProjectionScreen(double _focalDist, const Affine3d &_transformation, bo
     screen.setFocalDistance(_focalDist);
     screen.transform(_transformation);
     cam.init(screen);
+	if ( replayMode )
+		return;
 	if ( synchronous )
-		moveScreenAbsolute(_focalDist,homeFocalDistance,4500);
+		motors->moveScreenAbsolute(_focalDist,homeFocalDistance,4500);
 	else
-		moveScreenAbsoluteAsynchronous(_focalDist,homeFocalDistance,4500);
+		motors->moveScreenAbsoluteAsynchronous(_focalDist,homeFocalDistance,4500);
 }
 
 void initRendering()
@@ -1220,121 +2280,143 @@ void initRendering()
 	// Clean modelview matrix to start
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
+
+	if (useShaders)
+		shaders.init(LightPosition, LightAmbient, LightDiffuse);
+	gpuProfiler.init();
 }
 
-void initMotors()
+// Chooses real or simulated devices from the command line
+void initHardware(int argc, char *argv[])
 {
-	homeEverything(6000,4000);
+	string markerFile;
+	bool realtime = true;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--simulate")
+		{
+			simulatedHardware = true;
+			if (i+1 < argc && string(argv[i+1]).compare(0, 2, "--") != 0)
+				markerFile = argv[++i];
+		}
+		else if (arg == "--max-speed")
+			realtime = false;
+		else if (arg == "--record-markers" && i+1 < argc)
+			recordingMarkers = markerRecorder.open(argv[++i]);
+		else if (arg == "--free-run")
+			freeRunning = true;
+		else if (arg == "--fixed-function")
+			useShaders = false;
+		else if (arg == "--latch" && i+1 < argc)
+			latchMs = str2num<double>(argv[++i]);
+		else if (arg == "--realtime")
+		{
+			realtimeProfile.enabled = true;
+			if (i+1 < argc && isdigit(argv[i+1][0]))
+				realtimeProfile.renderCore = str2num<int>(argv[++i]);
+			if (i+1 < argc && isdigit(argv[i+1][0]))
+				realtimeProfile.acquisitionCore = str2num<int>(argv[++i]);
+		}
+	}
+
+	if (simulatedHardware)
+	{
+		tracker = new RecordedTracker(markerFile, OPTO_NUM_MARKERS, realtime);
+		motors = new SimulatedMotors();
+		audio = new SimulatedAudio();
+		return;
+	}
+	tracker = new OptotrakTracker(LastAlignedFile, OPTO_NUM_MARKERS, OPTO_FRAMERATE, OPTO_MARKER_FREQ, OPTO_DUTY_CYCLE, OPTO_VOLTAGE, calibration);
+	motors = new BrownMotors();
+#ifdef _WIN32
+	audio = new WindowsAudio();
+#else
+	audio = new SimulatedAudio();
+#endif
 }
 
-void initOptotrak()
+bool initMotors()
 {
-    optotrak.setTranslation(calibration);
+	motors->homeEverything(6000,4000);
+	return true;
+}
 
-    if ( optotrak.init(LastAlignedFile, OPTO_NUM_MARKERS, OPTO_FRAMERATE, OPTO_MARKER_FREQ, OPTO_DUTY_CYCLE,OPTO_VOLTAGE) != 0)
-    {   cerr << "Something during Optotrak initialization failed, press ENTER to continue. A error log has been generated, look \"opto.err\" in this folder" << endl;
-        cin.ignore(1E6,'\n');
-        exit(0);
+bool initOptotrak()
+{
+    if ( !tracker->init() )
+    {   cerr << "Something during Optotrak initialization failed. A error log has been generated, look \"opto.err\" in this folder" << endl;
+        return false;
     }
 
+    acquisition = new AcquisitionThread(tracker, head1, head2, head3);
+    if (realtimeProfile.enabled)
+        acquisition->setRealtime(realtimeProfile.acquisitionCore);
+    acquisition->start();
+    while (acquisition->getMarkers(markers, markersTime) == 0)
+        boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+
     // Read 10 frames of coordinates and fill the markers vector
     for (int i=0; i<10; i++)
     {
         updateTheMarkers();
     }
+    return true;
+}
+
+// The stereo window (or a plain one for the simulation), the GL state and the refresh rate
+bool initDisplay(int *argc, char *argv[])
+{
+	renderBackend = openDisplay(simulatedHardware, GAME_MODE_STRING, argc, argv, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (!renderBackend)
+		return false;
+	//glutFullScreen();
+	initRendering();
+	frameDurationMs = detectRefreshPeriod(renderBackend, frameDurationMs);
+	frameScheduler = FrameScheduler(frameDurationMs, latchMs, !freeRunning);
+	return true;
+}
+
+// The response keys are known once the parameters file is loaded
+bool initInput()
+{
+	if (continuousProbe)
+		inputThread = InputThread::launch(&inputQueue, continuousKeys, 0.25, true);
+	else
+		inputThread = InputThread::launch(&inputQueue, responseKeys);
+	return true;
+}
+
+// Idle callback of the scheduled loop: sleeps to the latch point, then the late latch of
+// input and markers and the redraw
+void scheduledFrame()
+{
+	frameScheduler.waitForLatch();
+	idle();
+	glutPostRedisplay();
 }
 
 void cleanup()
 {
+	if (inputThread)
+		inputThread->stop();
+	if (latencyFile.is_open())
+	{
+		responseTimes.writeSummary(latencyFile, parameters.find("SubjectName"), checkpoint.seed, checkpoint.trials);
+		latencyFile.close();
+	}
 	// Stop the optotrak
-	optotrak.stopCollection();
+	if (acquisition)
+		acquisition->stop();
+	tracker->stop();
+	frameScheduler.writeReport("schedulingJitter.txt", acquisition ? &acquisition->getWakeUpJitter() : NULL);
+	releaseTimerResolution();
 }
 
 void beepOk(int tone)
 {
-	#ifndef SIMULATION
-		switch(tone)
-		{
-		case 0:
-	    // Remember to put double slash \\ to specify directories!!!
-	    PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-1.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 1:
-	    PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\calibrate.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 2:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 3:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-reject.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 4:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-twoBlips.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 7:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-left.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 8:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-right.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 9:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-home.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 10:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-grasp.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 11:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-marker.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 12:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-estimate.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 13:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8_lowpass.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 14:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8_double.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 15:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-rising.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 16:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-falling.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 17:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-highBubblePop.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 18:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-lowBubblePop.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 19:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-success.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		case 20:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-watch.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-		}
-	#endif
-	return;
+	audio->play(tone);
+	responseTimes.feedback(hardwareClock());
 }
 
 ///////////////////////////////////////////////////////////
@@ -1343,22 +2425,98 @@ void beepOk(int tone)
 
 int main(int argc, char*argv[])
 {
-	mathcommon::randomizeStart();
-	
-	// Initializes the optotrak and starts the collection of points in background
-    initMotors();
-	initOptotrak();
-
-    glutInit(&argc, argv);
-	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_STEREO);
-	glutGameModeString(GAME_MODE_STRING);
-	glutEnterGameMode();
-	//glutFullScreen();
-	
-    initRendering();
-	initStreams(); // parameters file is loaded
-	
-	initVariables(); // staircases are built
+	// Offline replay: no tracker, no motors, offscreen buffers (or a plain window) instead of
+	// the stereo game mode. --replay-bench renders the same frames without saving them.
+	if (argc > 3 && (string(argv[1]) == "--replay" || string(argv[1]) == "--replay-bench"))
+	{
+		replaySaveFrames = string(argv[1]) == "--replay";
+		if (!initOfflineRendering(&argc, argv, "Gravity replay"))
+			return 1;
+
+		string outputDirectory = argv[2];
+		makeDirectory(outputDirectory);
+		for (int i = 3; i < argc; i++)
+		{
+			// one folder per trial file, named after the file
+			string trialFileName = argv[i];
+			size_t slash = trialFileName.find_last_of("/\\");
+			string baseName = trialFileName.substr(slash == string::npos ? 0 : slash+1);
+			baseName = baseName.substr(0, baseName.find_last_of('.'));
+			replayTrialFile(trialFileName, outputDirectory + "/" + baseName);
+		}
+		delete renderBackend;
+		return 0;
+	}
+
+	// Tracking load test: "--tracker-bench <markers> <rateHz> <seconds> [hands] [noiseSD]
+	// [occlusionsPerSecond] [occlusionMs] [pollMs]", no display
+	if (argc > 4 && string(argv[1]) == "--tracker-bench")
+	{
+		SyntheticMarkerConfig config;
+		int hands = argc > 5 ? str2num<int>(argv[5]) : 1;
+		config.rateHz = str2num<double>(argv[3]);
+		config.noiseSD = argc > 6 ? str2num<double>(argv[6]) : 0.1;
+		config.occlusionsPerSecond = argc > 7 ? str2num<double>(argv[7]) : 0;
+		config.occlusionMs = argc > 8 ? str2num<double>(argv[8]) : 50;
+		// the index finger, then one more hand every three markers after the rig's ones
+		config.bodies.resize(max(hands,1));
+		config.bodies[0].push_back(ind1);
+		config.bodies[0].push_back(ind2);
+		config.bodies[0].push_back(ind3);
+		for (int h = 1; h < hands; h++)
+			for (int k = 0; k < 3; k++)
+				config.bodies[h].push_back(OPTO_NUM_MARKERS + 3*(h-1) + k);
+		config.numMarkers = max(str2num<int>(argv[2]), OPTO_NUM_MARKERS + 3*(hands-1));
+		benchmarkTracker(config, str2num<double>(argv[4]), argc > 9 ? str2num<double>(argv[9]) : 0);
+		return 0;
+	}
+
+	// Golden frames: same rendering setup as the replay
+	if (argc > 2 && string(argv[1]) == "--golden")
+	{
+		string mode = argv[2];
+		if ((mode != "record" && mode != "check") || argc < 4)
+		{
+			cerr << "Usage: " << argv[0] << " --golden record|check <referenceDir> [tolerance]" << endl;
+			return 1;
+		}
+		if (!initOfflineRendering(&argc, argv, "Gravity golden frames"))
+			return 1;
+		int failures = goldenFrames(argv[3], mode == "record", argc > 4 ? str2num<int>(argv[4]) : 8);
+		delete renderBackend;
+		return failures;
+	}
+
+	// the random seed is chosen (or restored) in initStreams()
+	initHardware(argc, argv);
+	if (!initSubject())
+		return 0;
+
+	// Devices, display and parameters start together: the display stays on this thread,
+	// which owns the GL context, the other steps run on workers (see startupTimeline.txt)
+	StartupSequence startup;
+	startup.add("motors", initMotors);
+	startup.add("tracker", initOptotrak);
+	startup.add("display", boost::bind(initDisplay, &argc, argv), true);
+	int streams = startup.add("parameters", initStreams);
+	startup.after(startup.add("input", initInput), streams);
+	startup.after(startup.add("variables", initVariables), streams); // staircases are built
+	bool started = startup.run();
+	startup.writeTimeline("startupTimeline.txt");
+	if (!started)
+	{
+		// every worker has returned, so the program can stop here
+		cerr << "Startup failed, press ENTER to exit" << endl;
+		cin.ignore(1E6,'\n');
+		if (inputThread)
+			inputThread->stop();
+		if (acquisition)
+			acquisition->stop();
+		releaseTimerResolution();
+		delete renderBackend;
+		return 1;
+	}
+	applyRenderThreadProfile(realtimeProfile);
 	/*for(int d=0; d<360; d++){
 		// Frontoparallel circle at display depth
 		goalX[d] = cos(DEG2RAD*d)*targetRadius;
@@ -1366,17 +2524,26 @@ int main(int argc, char*argv[])
 		goalZ[d] = displayDepth-goalDepth;
 	}*/
     glutDisplayFunc(drawGLScene);
-    glutKeyboardFunc(handleKeypress);
+    glutKeyboardFunc(keyboardEvent);
+    if (continuousProbe)
+    {
+        // the hold is timed from press to release, the repeated presses would restart it
+        glutKeyboardUpFunc(keyboardUpEvent);
+        glutIgnoreKeyRepeat(1);
+    }
     glutReshapeFunc(handleResize);
-    glutIdleFunc(idle);
-    glutTimerFunc(TIMER_MS, update, 0);
+    if (freeRunning)
+    {
+        glutIdleFunc(idle);
+        glutTimerFunc((unsigned int)frameDurationMs, update, 0);
+    }
+    else
+        glutIdleFunc(scheduledFrame);
     glutSetCursor(GLUT_CURSOR_NONE);
 
-	//boost::thread initVariablesThread(&initVariables);
-
     glutMainLoop();
 
-	homeEverything(6000,4000);
+	motors->homeEverything(6000,4000);
     cleanup();
     return 0;
 }
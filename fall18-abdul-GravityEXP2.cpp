@@ -24,6 +24,7 @@
 
 #include <cstdlib>
 #include <cmath>
+#include <ctime>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
@@ -39,6 +40,10 @@
 #include <boost/thread/thread.hpp>
 #include <boost/asio.hpp>	//include asio in order to avoid the "winsock already declared problem"
 
+#ifdef GRAVITY_SHADERS
+#include <GL/glew.h>	// before any other GL header
+#endif
+
 #ifdef __APPLE__
 #include <OpenGL/OpenGL.h>
 #include <GLUT/glut.h>
@@ -65,6 +70,7 @@
 #include "GLUtils.h"
 #include "VRCamera.h"
 #include "CoordinatesExtractor.h"
+#include "RigidBodySolver.h"
 #include "CylinderPointsStimulus.h"
 #include "EllipsoidPointsStimulus.h"
 #include "StimulusDrawer.h"
@@ -81,6 +87,33 @@
 /***** CALIBRATION FILE *****/
 #include "LatestCalibration.h"
 
+/***** DISPLAY *****/
+// #define GRAVITY_OFFSCREEN to render headless through EGL (link libEGL)
+#include "RenderBackend.h"
+#include "ShaderPipeline.h"
+#include "GpuProfiler.h"
+
+/***** HARDWARE *****/
+#include "GravityHardware.h"
+#include "HeadTracking.h"
+#include "InputEvents.h"
+
+/***** STARTUP *****/
+#include <boost/bind.hpp>
+#include "StartupSequence.h"
+#include "RealtimeProfile.h"
+#include "FrameScheduler.h"
+
+/***** ADAPTIVE PROCEDURE *****/
+#include "GravityParameters.h"
+#include "PsiStaircase.h"
+
+/***** SESSION CHECKPOINT *****/
+#include "SessionCheckpoint.h"
+
+/***** RANDOM STREAMS *****/
+#include "GravityRandom.h"
+
 /***** DEFINE SIMULATION *****/
 //#define SIMULATION
 #ifndef SIMULATION
@@ -96,10 +129,14 @@ using namespace BrownMotorFunctions;
 using namespace BrownPhidgets;
 
 /********* #DEFINE DIRECTIVES **************************/
-#define TIMER_MS 11                               // 85 hz
 #define SCREEN_WIDTH  1024                  // 1024 pixels
 #define SCREEN_HEIGHT 768                   // 768 pixels
 
+// The stimulus speeds are in mm per frame of the 85 Hz display the experiments were
+// designed on; a frame lasts frameDurationMs, the refresh period found at startup
+const double referenceFrameMs = 11.76;
+double frameDurationMs = referenceFrameMs;
+
 double interoculardistance = 0;
 const float DEG2RAD = 3.14159/180;
 Screen screen;
@@ -109,7 +146,6 @@ double screenAlignmentZ = 0.0;
 
 /********* VARIABLES OBJECTS  **************************/
 VRCamera cam;
-Optotrak2 optotrak;
 CoordinatesExtractor headEyeCoords, thumbCoords, indexCoords, thumbJointCoords, indexJointCoords;
 Timer timer;
 Timer globalTimer;
@@ -118,6 +154,64 @@ clock_t t;
 /********* VISUALIZATION AND STIMULI *******************/
 static const bool gameMode=true;
 static const bool stereo=true;
+RenderBackend *renderBackend = NULL;
+// Built with GRAVITY_SHADERS (link GLEW) the surfaces are lit per pixel and the balls are
+// sphere impostors; "--fixed-function" keeps the fixed pipeline
+ShaderPipeline shaders;
+bool useShaders = true;
+
+/********* HARDWARE *******************/
+// Real devices on the rig. "--simulate [markerFile] [--max-speed]" (or #define SIMULATION)
+// plays back recorded markers instead and replaces the motors and the sounds;
+// "--record-markers <file>" saves the frames of the tracker for later playback.
+Tracker *tracker = NULL;
+Motors *motors = NULL;
+Audio *audio = NULL;
+MarkerStreamWriter markerRecorder;
+bool recordingMarkers = false;
+#ifdef SIMULATION
+bool simulatedHardware = true;
+#else
+bool simulatedHardware = false;
+#endif
+// The tracker is read on its own thread, which also tracks the eyes from the head markers
+AcquisitionThread *acquisition = NULL;
+double markersTime = 0;	// sample time of markers, on hardwareClock()
+
+// "--realtime [renderCore] [acquisitionCore]" pins the render and acquisition threads and
+// raises them to real-time priority; their timing goes to schedulingJitter.txt in any case
+RealtimeProfile realtimeProfile;
+
+// GPU time of the drawing phases, from timer queries in GRAVITY_SHADERS builds, with the
+// CPU frame times of the trial; both go to <subject>_frames.txt, one line per trial
+GpuProfiler gpuProfiler;
+const int gpuSurfaces = gpuProfiler.addPhase("surfaces");
+const int gpuCueBall = gpuProfiler.addPhase("cueBall");
+const int gpuProbe = gpuProfiler.addPhase("probe");
+const int gpuInfo = gpuProfiler.addPhase("info");
+JitterMonitor trialFrames;	// interval between swaps in the trial
+JitterMonitor trialDraw;	// CPU time from the start of drawGLScene() to the swap
+
+// The frame loop wakes once per refresh, "--latch <ms>" (default 4) before the vsync, to
+// read input and markers and draw; "--free-run" spins in idle() with redraws on a timer
+FrameScheduler frameScheduler;
+double latchMs = 4;
+bool freeRunning = false;
+
+// Head-tracked stereo (optional keys HeadTracking, PredictionLeadMs): 'h' attaches the
+// static eyes to the head markers, then the eyes follow the head, predicted to photon time
+bool headTracking = false;
+HeadTrackedEyes headEyes;
+
+// Key presses are queued with their time by keyboardEvent() and, for the response keys,
+// by an InputThread; idle() hands them to handleKeypress() with elapsed set to the press
+InputQueue inputQueue;
+InputThread *inputThread = NULL;
+const char *responseKeys = "12";
+double trialStartClock = 0;	// hardwareClock() when timer was started
+// Probe onset, response and feedback of each trial on the same clock
+ResponseTimes responseTimes;
+double predictionLeadMs = 18;
 
 /********* MARKERS AND 3D VECTORS ****************************/
 // fingers markers numbers
@@ -128,6 +222,13 @@ int calibration1 = 1, calibration2 = 2;
 int screen1 = 19, screen2 = 20, screen3 = 21;
 int mirror1 = 6, mirror2 = 22;
 int centercalMarker = 4;
+int head1 = 7, head2 = 8, head3 = 9;
+
+// The finger points are solved together from each frame; a joint is one more body on the
+// same markers. The thumb stays uncalibrated, and invisible, until it gets a calibration.
+RigidBodySolver handSolver;
+const int indexBody = handSolver.addBody(ind1, ind2, ind3);
+const int thumbBody = handSolver.addBody(thu1, thu2, thu3);
 
 Vector3d eyeLeft, eyeRight;
 Vector3d ind, thm;
@@ -145,6 +246,16 @@ bool visibleInfo=true;
 
 /********* FILE STREAMS *************************************/
 ofstream trialFile;
+ofstream headFile;		// head motion-to-photon latency and prediction error, one line per trial
+ofstream latencyFile;	// input-to-feedback latency, one line per session
+ofstream framesFile;	// CPU and GPU frame times, one line per trial
+SessionCheckpoint checkpoint;
+string checkpointFileName;
+bool resuming = false;
+
+/********* RANDOM STREAMS *************************************/
+RandomStream scheduleStream;	// condition order
+RandomStream probeStream;		// probeDistance, drawn by trial number
 
 /*************************************************************************************/
 /*** Everything above this point stays more or less the same between experiments.  ***/
@@ -154,6 +265,10 @@ ofstream trialFile;
 // Experiment variables
 ParametersLoader parameters; //high level variables from parameters file
 TrialGenerator<double> trial; //chnaged from balancefactor 
+PsiTrialGenerator psiTrial; // replaces trial when the parameters file says "Procedure: psi"
+bool usePsi = false;
+map<string,double> currentFactors; // factor levels of the current trial, from trial or psiTrial
+string subjectDirectory;
 
 // FOR NEW CALIBRATION:
 double markerXOffset = 10;
@@ -263,6 +378,8 @@ GLfloat tableMaterial[] = {1.0, 0.0, 0.0, 1.0};
 GLfloat ballMaterial[] = {1.0, 0.0, 0.0, 1.0};
 GLfloat noiseMaterial[] = {1.0, 0.0, 0.0, 1.0};
 GLfloat lineMaterial[] = {0.0, 0.0, 0.0, 1.0};
+const int tableMaterialId = shaders.addMaterial(tableMaterial);
+const int ballMaterialId = shaders.addMaterial(ballMaterial);
 GLfloat shininessMaterial = 32.0f;
 // To use the motors:
 // 0. homeEverything(arm speed, screen speed) brings all motors to their start positions, nearest to the mirror.
@@ -287,25 +404,53 @@ void drawFingers();
 void drawStimulus();
 void drawResponseGrid();
 void handleKeypress(unsigned char k, int x, int y);
+void keyboardEvent(unsigned char k, int x, int y);
+void processInput();
 void handleResize(int w, int h);
 void idle();
-void initMotors();
-void initOptotrak();
+void initHardware(int argc, char *argv[]);
+bool initMotors();
+bool initOptotrak();
+bool initDisplay(int *argc, char *argv[]);
+bool initInput();
+void scheduledFrame();
 void initProjectionScreen(double _focalDist, const Affine3d &_transformation=Affine3d::Identity(),bool synchronous=true);
 void initRendering();
-void initStreams();
+bool initSubject();
+bool initStreams();
 void initTrial();
-void initVariables();
+bool initVariables();
+void initRandomStreams(unsigned int seed);
+void randomizeTrial();
+void resumeSession();
 void update(int value);
 void updateTheMarkers();
+void writeFrameProfile();
+void writePsiEstimates();
 
 // online operations
-bool cue();
-bool probe();
+template <int PHASE, int ORDER> bool cue();
+template <int ORDER> bool probe();
+template <int PHASE, int ORDER> void updateTrial();
+template <int PHASE, int ORDER> bool showCue();
+template <int ORDER> bool showProbe();
 bool sleep();
 void online_apparatus_alignment();
 void online_fingers();
 void online_trial();
+void startTrialMotion();
+void benchmarkTrialVariants(int trials, int frames);
+
+// The per-frame trial logic, compiled once for every Phase/Order combination and picked at
+// the start of the trial, so online_trial() and drawStimulus() do not branch on them
+struct TrialVariant
+{
+	void (*update)();		// moves the balls, once per frame
+	bool (*showCue)();		// the cue ball is drawn (advances it, as drawStimulus() always did)
+	bool (*showProbe)();	// the probe ball is drawn
+};
+TrialVariant selectTrialVariant(int phase, int order);
+TrialVariant trialVariant = selectTrialVariant(0, 0);	// nothing moves or shows before the first trial
 
 
 /*************************** EXPERIMENT SPECS ****************************/
@@ -313,49 +458,106 @@ void online_trial();
 string experiment_directory = "R:/CLPS_Domini_Lab/abdul/fall18-GravityEXP2/";
 // parameters file directory and name
 string parametersFile_directory = experiment_directory + "fall18-GravityEXP2Parameters.txt";
+// file headers (the trial file ones depend on the Phase, see initStreams())
+string headFile_headers = "subjName\ttrialN\theadTracking\tframes\tmeasured\tbridged\tlost\tmeanLatencyMs\tmaxLatencyMs\terrorRMS\terrorMax";
+string framesFile_headers = "subjName\ttrialN\tframes\tframeMs\tframeP99Ms\tlateFrames\tcpuDrawMs\tcpuDrawMaxMs\tgpuFrames\tgpuDropped\tgpuSurfacesMs\tgpuCueBallMs\tgpuProbeMs\tgpuInfoMs\tgpuFrameMs\tgpuFrameP99Ms\tgpuFrameMaxMs";
+string latencyFile_headers = "subjName\tseed\ttrials\tkeys\tmeanLatencyMs\tmedianLatencyMs\tp95LatencyMs\tmaxLatencyMs";
 
 
 /*************************** FUNCTIONS ***********************************/
 // First, make sure the filenames in here are correct and that the folders exist.
 // If you mess this up, data may not be recorded!
-void initStreams()
+// Loads the parameters and checks the subject: an existing subject file is only accepted
+// if its session was interrupted. Runs before the startup steps, so that nothing has
+// moved yet when it refuses the subject.
+bool initSubject()
 {
 	ifstream parametersFile;
 	parametersFile.open(parametersFile_directory.c_str());
 	parameters.loadParameterFile(parametersFile);
 
 	string subjectName = parameters.find("SubjectName");
-	string Phase_index = parameters.find("Phase");
-	Phase = str2num<int>(Phase_index);
-
-	// trialFile directory
 	string dirName  = experiment_directory + subjectName;
 	mkdir(dirName.c_str()); // windows syntax
 
+	checkpointFileName = dirName + "/" + subjectName + "_checkpoint.txt";
 	if (util::fileExists(dirName+"/"+subjectName + ".txt"))
 	{
-		string error_on_file_io = dirName+"/"+subjectName+".txt" + string(" already exists");
-		cerr << error_on_file_io << endl;
-		MessageBox(NULL, (LPCSTR)"FILE ALREADY EXISTS\n Please check the parameters file.",NULL, NULL);
-		exit(0);
+		if (checkpoint.load(checkpointFileName) && !checkpoint.finished)
+		{
+			resuming = true;
+			cerr << "Resuming " << subjectName << " after trial " << checkpoint.trials << endl;
+		}
+		else
+		{
+			string error_on_file_io = dirName+"/"+subjectName+".txt" + string(" already exists");
+			cerr << error_on_file_io << endl;
+			MessageBox(NULL, (LPCSTR)"FILE ALREADY EXISTS\n Please check the parameters file.",NULL, NULL);
+			return false;
+		}
 	}
+	return true;
+}
+
+bool initStreams()
+{
+	string subjectName = parameters.find("SubjectName");
+	string Phase_index = parameters.find("Phase");
+	Phase = str2num<int>(Phase_index);
+
+	// optional keys
+	map<string,string> optionalParameters = readParameterLines(parametersFile_directory);
+	headTracking = findParameter<int>(optionalParameters, "HeadTracking", 0) != 0;
+	predictionLeadMs = findParameter<double>(optionalParameters, "PredictionLeadMs", 18.0);
+	usePsi = findParameter(optionalParameters, "Procedure", "staircase") == "psi";
+
+	// trialFile directory
+	string dirName  = experiment_directory + subjectName;
+	subjectDirectory = dirName;
+
+	// A new session takes its seed from the parameters file or the clock, a resumed one
+	// reuses the seed of the checkpoint. Every random stream derives from this seed.
+	if (!resuming){
+		checkpoint.seed = findParameter<unsigned int>(optionalParameters, "Seed", 0);
+		if (checkpoint.seed == 0)
+			checkpoint.seed = (unsigned int)time(NULL);
+	}
+	initRandomStreams(checkpoint.seed);
 
 	globalTimer.start();
 	string trialFile_headers;
 	//Will fix this later. Needs to change headers depending on testing phase. 
 	// trial file headers
 	if (Phase == 1){
-		trialFile_headers = "subjName\ttrialN\tPhase\tspeed\telapsed\tframeN\tProbePhase\tProbeBallEdge\tprobeSpeed\tresponse\tballPos_z\tballPos_y";
+		trialFile_headers = "subjName\ttrialN\tPhase\tspeed\telapsed\tframeN\tProbePhase\tProbeBallEdge\tprobeSpeed\tresponse\tballPos_z\tballPos_y\tprobeOnsetMs\tfirstKeyRTMs\tresponseRTMs\tfeedbackLatencyMs\tframeMs";
 	}
 	else if (Phase == 2){
-		trialFile_headers = "subjName\ttrialN\tPhase\tGravity\telapsed\tframeN\tProbePhase\tProbeBallEdge\tprobeSpeed\tresponse\tballPos_z\tballPos_y";
+		trialFile_headers = "subjName\ttrialN\tPhase\tGravity\telapsed\tframeN\tProbePhase\tProbeBallEdge\tprobeSpeed\tresponse\tballPos_z\tballPos_y\tprobeOnsetMs\tfirstKeyRTMs\tresponseRTMs\tfeedbackLatencyMs\tframeMs";
 	}
 	else{
-		trialFile_headers = "subjName\ttrialN\tPhase\tspeed\tGravity\telapsed\tframeN\tProbePhase\tProbeBallEdge\tprobeSpeed\tresponse\tballPos_z\tballPos_y";
+		trialFile_headers = "subjName\ttrialN\tPhase\tspeed\tGravity\telapsed\tframeN\tProbePhase\tProbeBallEdge\tprobeSpeed\tresponse\tballPos_z\tballPos_y\tprobeOnsetMs\tfirstKeyRTMs\tresponseRTMs\tfeedbackLatencyMs\tframeMs";
 	}
 	string trialFileName = dirName + "/" + subjectName + ".txt";
-	trialFile.open(trialFileName.c_str());
-	trialFile << fixed << trialFile_headers << endl;
+	string headFileName = dirName + "/" + subjectName + "_head.txt";
+	string latencyFileName = dirName + "/" + subjectName + "_latency.txt";
+	string framesFileName = dirName + "/" + subjectName + "_frames.txt";
+	if (resuming){
+		trialFile.open(trialFileName.c_str(), ios::app);
+		headFile.open(headFileName.c_str(), ios::app);
+		latencyFile.open(latencyFileName.c_str(), ios::app);
+		framesFile.open(framesFileName.c_str(), ios::app);
+	}
+	else{
+		trialFile.open(trialFileName.c_str());
+		trialFile << fixed << trialFile_headers << endl;
+		headFile.open(headFileName.c_str());
+		headFile << headFile_headers << endl;
+		latencyFile.open(latencyFileName.c_str());
+		latencyFile << latencyFile_headers << endl;
+		framesFile.open(framesFileName.c_str());
+		framesFile << framesFile_headers << endl;
+	}
+	return true;
 }
 
 // Edit case 'f' to establish calibration procedure
@@ -391,12 +593,23 @@ void handleKeypress(unsigned char key, int x, int y){
 				if(trialFile.is_open()){
 					trialFile.close();
 				}
-				homeEverything(5000,4500);
+				motors->homeEverything(5000,4500);
 				cleanup();
 				exit(0);
 			}
 			break;
 
+		case 'h':
+		case 'H':
+			{
+				// sit in the reference position first, again after changing the IOD
+				if (acquisition && acquisition->calibrate(Vector3d(-interoculardistance/2,0,0), Vector3d(interoculardistance/2,0,0)))
+					beepOk(0);
+				else
+					beepOk(3);
+			}
+			break;
+
 		case 'f':
 		case 'F':
 			{
@@ -406,7 +619,7 @@ void handleKeypress(unsigned char key, int x, int y){
 					indexCalibrationPoint=markers.at(1).p;
 					indexCalibrationPoint[0] = indexCalibrationPoint[0] - 7;
 					indexCalibrationPoint[1] = indexCalibrationPoint[0] + 10;
-					indexCoords.init(indexCalibrationPoint, markers.at(ind1).p, markers.at(ind2).p, markers.at(ind3).p );
+					handSolver.init(indexBody, indexCalibrationPoint, markers);
 
 					fingerCalibrationDone=3;
 					fingersCalibrated=true;*/
@@ -429,6 +642,7 @@ void handleKeypress(unsigned char key, int x, int y){
 					else if (Order == 2){
 					response = false;
 					}
+					responseTimes.respond();
 					beepOk(19);	
 					advanceTrial(); 
 
@@ -446,6 +660,7 @@ void handleKeypress(unsigned char key, int x, int y){
 					else if (Order == 2){
 					response = true;
 					}
+					responseTimes.respond();
 					beepOk(19);	
 					advanceTrial(); 
 				}
@@ -455,6 +670,28 @@ void handleKeypress(unsigned char key, int x, int y){
 	}
 }
 
+// GLUT keyboard callback: only queues the key with the time it was dispatched
+void keyboardEvent(unsigned char key, int x, int y)
+{
+	if (!inputThread || !inputThread->watches(key))
+		inputQueue.push(key, hardwareClock());
+}
+
+// Handles the queued key presses; while handling one, elapsed is the time of the press
+// in the current trial, so the responses are logged with the time they were given
+void processInput()
+{
+	InputEvent event;
+	while (inputQueue.pop(event))
+	{
+		elapsed = event.time - trialStartClock;
+		responseTimes.key(event.time);
+		handleKeypress(event.key, 0, 0);
+		responseTimes.keyHandled();
+	}
+	elapsed = timer.getElapsedTimeInMilliSec();
+}
+
 /*** GRASP ***/
 void calibration_fingers(int phase)
 {
@@ -498,9 +735,11 @@ void drawInfo()
 			text.draw("#");
 			text.draw("# Name: " + parameters.find("SubjectName"));
 			text.draw("# IOD: " + stringify<double>(interoculardistance));
+			text.draw("# Seed: " + stringify<unsigned int>(checkpoint.seed));
 			text.draw("# trial: " + stringify<float>(trialNumber));
 			text.draw("# Phase:" +stringify<int>(Phase));
 			text.draw("# Order:" +stringify<int>(Order));
+			text.draw("# Procedure: " + string(usePsi ? "psi" : "staircase"));
 			text.draw("# Displayed Velocity:" + stringify<double>(speed));
 			text.draw("# Displayed Acceleration:" + stringify<double>(Gravity));
 			text.draw("# probeDistance:" + stringify<double>(probeDistance));
@@ -617,27 +856,41 @@ void drawGLScene()
 {
 	online_apparatus_alignment();
 	online_fingers();
+	// the eyes follow the head once 'h' has calibrated, the static ones set in idle() stay
+	// whenever the head is lost
+	if (headTracking && acquisition)
+		headEyes.update(*acquisition, hardwareClock() + predictionLeadMs, eyeLeft, eyeRight);
 	online_trial();
 
+	double drawStart = hardwareClock();
+	gpuProfiler.beginFrame();
 	if (stereo)
-    {   glDrawBuffer(GL_BACK);
-		// Draw left eye view
-        glDrawBuffer(GL_BACK_LEFT);
+    {   // Draw left eye view
+        renderBackend->beginEye(LEFT_EYE);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glClearColor(0.0,0.0,0.0,1.0);
         cam.setEye(eyeLeft);
+        shaders.beginEye(eyeLeft);
+        gpuProfiler.start();
         drawStimulus();
 		drawInfo();
+        gpuProfiler.stamp(gpuInfo);
 
         // Draw right eye view
-        glDrawBuffer(GL_BACK_RIGHT);
+        renderBackend->beginEye(RIGHT_EYE);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glClearColor(0.0,0.0,0.0,0.0);
         cam.setEye(eyeRight);
+        shaders.beginEye(eyeRight);
+        gpuProfiler.start();
         drawStimulus();
 		drawInfo();
+        gpuProfiler.stamp(gpuInfo);
 
-        glutSwapBuffers();
+        trialDraw.add(hardwareClock() - drawStart);
+        renderBackend->swap();
+        gpuProfiler.endFrame();
+        frameScheduler.frameShown(&trialFrames);
     }
     /*else
     {   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -645,6 +898,7 @@ void drawGLScene()
         glMatrixMode(GL_MODELVIEW);
         glLoadIdentity();
         cam.setEye(eyeRight);
+        shaders.beginEye(eyeRight);
         drawStimulus();
 		drawInfo();
         glutSwapBuffers();
@@ -656,6 +910,7 @@ void drawStimulus()
 {
 
 	//1. Draw Table Surface 
+	shaders.useMaterial(tableMaterialId);
 	glBegin(GL_QUADS);
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, tableMaterial);
 	glVertex3f(Tablex1, Tabley1,TableZ1); // vertex 1
@@ -681,10 +936,15 @@ void drawStimulus()
 	glVertex3f(Floorx2, Floory1,Floorz2); // vertex 3
 	glVertex3f(Floorx1, Floory1,Floorz2); // vertex 4
 	glEnd();
+	gpuProfiler.stamp(gpuSurfaces);
 	
 	// 4. Draw cue ball
-	if((Order == 1 && !ProbePhase && !cue())||(Order == 2 && !ProbePhase && !cue() &&(elapsed > lastTimeProbe + Probe2CueDelay))) {
+	if(trialVariant.showCue()) {
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		if (shaders.isAvailable())
+			shaders.drawSphere(Vector3d(cueCenter_x,cueCenter_y,cueCenter_z), cueRadius, ballMaterialId);
+		else
+		{
 		glPushMatrix();
 		glLoadIdentity();
 		GLUquadricObj* cueBall = gluNewQuadric();
@@ -694,11 +954,17 @@ void drawStimulus()
 		gluSphere(cueBall, cueRadius, 64, 64);
 		gluDeleteQuadric(cueBall);
 		glPopMatrix();
+		}
 	}
+	gpuProfiler.stamp(gpuCueBall);
 			
 	// 5. Draw response ball
-	if((Order == 2 && ProbePhase && !ProbeBallEdge)|| (Order == 1 && ProbePhase && !ProbeBallEdge && (elapsed > lastFrameCue + Probe2CueDelay))) {//  after display period NEEDS TO BE FIXED FOR OTHER ORDERES || (ProbePhase && Order == 2 )
+	if(trialVariant.showProbe()) {//  after display period NEEDS TO BE FIXED FOR OTHER ORDERES || (ProbePhase && Order == 2 )
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		if (shaders.isAvailable())
+			shaders.drawSphere(Vector3d(probeCenter_x,probeCenter_y,probeCenter_z), cueRadius, ballMaterialId);
+		else
+		{
 		glPushMatrix();
 		glLoadIdentity();
 		GLUquadricObj* cueBall = gluNewQuadric();
@@ -708,9 +974,12 @@ void drawStimulus()
 		gluSphere(cueBall, cueRadius, 64, 64);
 		gluDeleteQuadric(cueBall);
 		glPopMatrix();
+		}
 
 		
 	}
+	gpuProfiler.stamp(gpuProbe);
+	shaders.end();
 }
 
 //Probe2CueDelay
@@ -728,51 +997,79 @@ void initTrial()
 	trialFile << fixed << trialFile_headers << endl;*/
 
 	frameN=0;
-	Order = trial.getCurrent().first["Order"];
-	cueVelSet = false;
-	ProbePhase = (Order == 1) ? false : true;
-	CueBallEdge = false; 
-	ProbeBallEdge = false;
-	response = -1;
+	headEyes.resetMetrics();
+	responseTimes.reset();
+	trialFrames.reset();
+	trialDraw.reset();
+	gpuProfiler.reset();
+	currentFactors = usePsi ? psiTrial.getCurrent().first : trial.getCurrent().first;
+	Order = currentFactors["Order"];
 
 	//1. Horizontal Test for Vz
 	if (Phase ==1){
-		double speed_index = trial.getCurrent().first["Speed"];
+		double speed_index = currentFactors["Speed"];
 		speed = speed_index;
-		cueCenter_x = 0;
-		cueCenter_y = -62;
-		cueCenter_z = ballStartPos_z;
-
 	} 
 	//2.Horizontal Test for Vy
 	else if (Phase == 2){
-		Gravity = trial.getCurrent().first["Gravity"];
-		cueCenter_x = 0;
-		cueCenter_y = -62;
-		cueCenter_z = TableZ1 +12;
-
+		Gravity = currentFactors["Gravity"];
 	}
 
 	//3. Horizontal Test, full trajectory 
 	else {
-		speed = trial.getCurrent().first["Speed"];
-		Gravity = trial.getCurrent().first["Gravity"];
-		cueCenter_x = 0;
-		cueCenter_y = -62;
-		cueCenter_z = ballStartPos_z;
-
+		speed = currentFactors["Speed"];
+		Gravity = currentFactors["Gravity"];
 		}
-	probeDistance = rand() % 175 + 68 ;
-	probeCenter_x = -1*(probeDistance/2);
-	probeCenter_y = -62;
-	probeCenter_z = TableZ1 -20;
-	probeSpeed = trial.getCurrent().second->getCurrentStaircase()->getState();
+	randomizeTrial();
+	startTrialMotion();
+	if (usePsi)
+		probeSpeed = psiTrial.getCurrent().second->getState();
+	else
+		probeSpeed = trial.getCurrent().second->getCurrentStaircase()->getState();
 
 	initProjectionScreen(displayDepth);
 
 	// roll on
 	drawGLScene();
 	timer.start();
+	trialStartClock = hardwareClock();
+}
+
+// Puts both balls at their start for the current Phase and Order and picks the trial variant
+void startTrialMotion()
+{
+	cueVelSet = false;
+	ProbePhase = (Order == 1) ? false : true;
+	CueBallEdge = false; 
+	ProbeBallEdge = false;
+	response = -1;
+
+	cueCenter_x = 0;
+	cueCenter_y = -62;
+	cueCenter_z = Phase == 2 ? TableZ1 +12 : ballStartPos_z;
+	probeCenter_x = -1*(probeDistance/2);
+	probeCenter_y = -62;
+	probeCenter_z = TableZ1 -20;
+
+	trialVariant = selectTrialVariant(Phase, Order);
+}
+
+// One independent stream per subsystem, all derived from the session seed.
+// TrialGenerator shuffles with rand(), which gets its seed from the schedule stream.
+void initRandomStreams(unsigned int seed)
+{
+	scheduleStream = RandomStream(seed, RNG_SCHEDULE);
+	probeStream = RandomStream(seed, RNG_PROBE);
+	srand((unsigned int)scheduleStream.next());
+	psiTrial.setRandomStream(&scheduleStream);
+	cerr << "Random seed: " << seed << endl;
+}
+
+// Every random draw of a trial goes here. Draws are indexed by the trial number, so they
+// do not depend on what happened in the previous trials.
+void randomizeTrial()
+{
+	probeDistance = probeStream.uniformIntAt(trialNumber, 175) + 68 ;
 }
 
 // This function handles the transition from the end of one trial to the beginning of the next.
@@ -790,7 +1087,12 @@ void advanceTrial() {
 			probeSpeed << "\t" <<
 			response << "\t"<<
 			ballPos_z << "\t" <<
-			ballPos_y << endl;
+			ballPos_y << "\t" <<
+			responseTimes.getOnset(trialStartClock) << "\t" <<
+			responseTimes.getFirstKeyTime() << "\t" <<
+			responseTimes.getReactionTime() << "\t" <<
+			responseTimes.getFeedbackLatency() << "\t" <<
+			frameDurationMs << endl;
 	}
 	else if (Phase == 2){
 		trialFile << fixed <<
@@ -805,7 +1107,12 @@ void advanceTrial() {
 			probeSpeed << "\t" <<
 			response << "\t"<<
 			ballPos_z << "\t" <<
-			ballPos_y << endl;
+			ballPos_y << "\t" <<
+			responseTimes.getOnset(trialStartClock) << "\t" <<
+			responseTimes.getFirstKeyTime() << "\t" <<
+			responseTimes.getReactionTime() << "\t" <<
+			responseTimes.getFeedbackLatency() << "\t" <<
+			frameDurationMs << endl;
 	}
 	else{
 		trialFile << fixed <<
@@ -821,10 +1128,31 @@ void advanceTrial() {
 			probeSpeed << "\t" <<
 			response << "\t"<<
 			ballPos_z << "\t" <<
-			ballPos_y << endl;
+			ballPos_y << "\t" <<
+			responseTimes.getOnset(trialStartClock) << "\t" <<
+			responseTimes.getFirstKeyTime() << "\t" <<
+			responseTimes.getReactionTime() << "\t" <<
+			responseTimes.getFeedbackLatency() << "\t" <<
+			frameDurationMs << endl;
 	}
-
-	if(!trial.isEmpty()){
+	headEyes.writeTrial(headFile, parameters.find("SubjectName"), trialNumber, headTracking);
+	writeFrameProfile();
+	checkpoint.responses.push_back(response);
+	checkpoint.trials = (int)checkpoint.responses.size();
+
+	if (usePsi){
+		// the psi update uses every answer, including the one of the last trial
+		psiTrial.next(response);
+		if(!psiTrial.isEmpty()){
+			trialNumber++;
+			initTrial();
+		}
+		else{
+			writePsiEstimates();
+			finished=true;
+		}
+	}
+	else if(!trial.isEmpty()){
 		trial.next(response);
 		trialNumber++;
 		initTrial();
@@ -832,6 +1160,12 @@ void advanceTrial() {
 	else{
 		finished=true;
 	}
+
+	// probeSpeed now belongs to the next trial, resumeSession() checks it after replaying
+	checkpoint.finished = finished;
+	checkpoint.nextState = probeSpeed;
+	checkpoint.hasNextState = !finished;
+	checkpoint.save(checkpointFileName);
 	//if(trialFile.is_open())
 	//	trialFile.close();
 }
@@ -839,6 +1173,7 @@ void advanceTrial() {
 void idle() {
 
 	elapsed = timer.getElapsedTimeInMilliSec();
+	processInput();
 
 	// get new marker positions from optotrak
 	updateTheMarkers();
@@ -850,6 +1185,28 @@ void idle() {
 
 
 
+// Threshold and slope estimated by each psi staircase, written when the session is over
+void writePsiEstimates()
+{
+	string psiFileName = subjectDirectory + "/" + parameters.find("SubjectName") + "_psi.txt";
+	ofstream psiFile(psiFileName.c_str());
+	psiFile << fixed << "subjName\tPhase\tGravity\tSpeed\tOrder\ttrials\tthreshold\tthresholdSD\tslope" << endl;
+	for (size_t c = 0; c < psiTrial.size(); c++){
+		map<string,double> condition = psiTrial.getCondition(c);
+		const PsiStaircase &psi = psiTrial.getStaircase(c);
+		psiFile << fixed <<
+			parameters.find("SubjectName") << "\t" <<
+			Phase << "\t" <<
+			condition["Gravity"] << "\t" <<
+			condition["Speed"] << "\t" <<
+			condition["Order"] << "\t" <<
+			psi.getStepsDone() << "\t" <<
+			psi.getThreshold() << "\t" <<
+			psi.getThresholdSD() << "\t" <<
+			psi.getSlope() << endl;
+	}
+}
+
 /*** Online operations ***/
 void online_apparatus_alignment()
 {
@@ -885,6 +1242,30 @@ void online_apparatus_alignment()
 	}
 }
 
+// CPU frame times of the trial and the GPU time of each drawing phase, mean over frames
+void writeFrameProfile()
+{
+	framesFile << fixed <<
+	parameters.find("SubjectName") << "\t" <<
+	trialNumber << "\t" <<
+	trialFrames.getCount() << "\t" <<
+	trialFrames.getMean() << "\t" <<
+	trialFrames.getPercentile(99) << "\t" <<
+	trialFrames.countOver(frameDurationMs*1.5) << "\t" <<
+	trialDraw.getMean() << "\t" <<
+	trialDraw.getMax() << "\t" <<
+	gpuProfiler.getTotal().getCount() << "\t" <<
+	gpuProfiler.getDroppedFrames();
+	// -1 without timer queries
+	bool gpu = gpuProfiler.isAvailable();
+	for (int phase = 0; phase < gpuProfiler.getPhaseCount(); phase++)
+		framesFile << "\t" << (gpu ? gpuProfiler.getPhase(phase).getMean() : -1);
+	framesFile << "\t" <<
+	(gpu ? gpuProfiler.getTotal().getMean() : -1) << "\t" <<
+	(gpu ? gpuProfiler.getTotal().getPercentile(99) : -1) << "\t" <<
+	(gpu ? gpuProfiler.getTotal().getMax() : -1) << endl;
+}
+
 void online_fingers()
 {
 	// Visibility check
@@ -892,20 +1273,14 @@ void online_fingers()
 	//allVisibleThumb = isVisible(markers.at(thu1).p) && isVisible(markers.at(thu2).p) && isVisible(markers.at(thu3).p);
 	allVisibleFingers = allVisibleIndex;
 
-	// fingers coordinates, fingersOccluded and framesOccluded
-	if ( allVisibleFingers )
-	{
-		indexCoords.update(markers.at(ind1).p, markers.at(ind2).p, markers.at(ind3).p );
-		//thumbCoords.update(markers.at(thu1).p, markers.at(thu2).p, markers.at(thu3).p );
-		//indexJointCoords.update(markers.at(ind1).p, markers.at(ind2).p, markers.at(ind3).p );
-		//thumbJointCoords.update(markers.at(thu1).p, markers.at(thu2).p, markers.at(thu3).p );
-	}
+	// fingers coordinates, every body in one pass; occluded bodies keep their last position
+	handSolver.solve(markers);
 
 	if(fingersCalibrated)
 	{
 		// index coordinates
 		if(allVisibleIndex){
-			ind = indexCoords.getP1();
+			ind = handSolver.getPoint(indexBody);
 			//if(fingerCalibrationDone>=3)
 			//	indJoint = indexJointCoords.getP1();
 		}
@@ -918,12 +1293,14 @@ void online_fingers()
 	}
 }
 
-bool cue(){ // Updates the ball position and returns true only if the cue phase is done
+// Updates the ball position and returns true only if the cue phase is done
+template <int PHASE, int ORDER>
+bool cue(){
 	
 	if(!ProbePhase){
 		
 		//Check for distance with table edge Cue
-		if (Phase == 1){
+		if (PHASE == 1){
 
 			
 
@@ -937,12 +1314,12 @@ bool cue(){ // Updates the ball position and returns true only if the cue phase
 
 			}else{
 				//update ball positions		
-				cueCenter_z += speed;
+				cueCenter_z += speed*frameDurationMs/referenceFrameMs;
 			}
 
 			return distanceBetween_z <= 0; // Cue phase is over
 		
-		} else if (Phase == 2){
+		} else if (PHASE == 2){
 			//Check for distance with floor Cue
 
 			float distanceBetween_y = Floory1 - cueCenter_y;
@@ -954,10 +1331,10 @@ bool cue(){ // Updates the ball position and returns true only if the cue phase
 				
 			}else {
 				// update cueball positions 
-				if(Order == 1){
-				cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(11.76*(frameN -1), 2);
-				}else if(Order ==2){
-				cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(11.76*(frameN -lastFrameProbe), 2);
+				if(ORDER == 1){
+				cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(frameDurationMs*(frameN -1), 2);
+				}else if(ORDER ==2){
+				cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(frameDurationMs*(frameN -lastFrameProbe), 2);
 				}
 			}
 			return distanceBetween_y >= -1*cueRadius;
@@ -971,11 +1348,13 @@ bool cue(){ // Updates the ball position and returns true only if the cue phase
 					// when the ball touches the ground 
 					CueBallEdge = true;
 					frameOfFall = frameN+1;
+					if (ORDER == 2)
+						responseTimes.stimulusOnset(trialStartClock + elapsed);
 					std::cout << frameOfFall << "  " << frameN << std::endl;
 				}
 
 				// Update position for constant velocity
-				cueCenter_z += speed;
+				cueCenter_z += speed*frameDurationMs/referenceFrameMs;
 
 			} else { // falling
 
@@ -990,10 +1369,10 @@ bool cue(){ // Updates the ball position and returns true only if the cue phase
 
 				} else { // still falling
 
-					cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(11.76*(frameN-frameOfFall), 2);
+					cueCenter_y = (Tabley1+cueRadius) - 0.5*(Gravity/1000)*pow(frameDurationMs*(frameN-frameOfFall), 2);
 						if (cueCenter_y < Floory1 + cueRadius){
 						cueCenter_y = Floory1 + cueRadius;
-						cueCenter_z = (speed/11.76)* sqrt(75*(2000/Gravity)) -600;
+						cueCenter_z = (speed/referenceFrameMs)* sqrt(75*(2000/Gravity)) -600;
 					}
 
 					return cueCenter_y <= -129.83;
@@ -1006,7 +1385,9 @@ bool cue(){ // Updates the ball position and returns true only if the cue phase
 }
 
 
-bool probe(){ // Updates the ball position and returns true only if the probe phase is done
+// Updates the ball position and returns true only if the probe phase is done
+template <int ORDER>
+bool probe(){
 
 	if(ProbePhase){
 
@@ -1018,10 +1399,12 @@ bool probe(){ // Updates the ball position and returns true only if the probe ph
 				// when the ball hits edge
 				ProbeBallEdge = true;
 				lastTimeProbe = elapsed;
-				lastFrameProbe = frameN + (Probe2CueDelay/11.76); //includes delay frames
+				if (ORDER == 1) // the probe is the second ball, the one the answer follows
+					responseTimes.stimulusOnset(trialStartClock + lastTimeProbe);
+				lastFrameProbe = frameN + (Probe2CueDelay/frameDurationMs); //includes delay frames
 				}
 			if(!ProbeBallEdge){//update probe movement 
-				probeCenter_x += probeSpeed;
+				probeCenter_x += probeSpeed*frameDurationMs/referenceFrameMs;
 			}
 		}
 
@@ -1031,6 +1414,63 @@ bool probe(){ // Updates the ball position and returns true only if the probe ph
 	return false;
 }
 
+// Order 1 rolls the cue ball first and the probe after the delay, Order 2 the other way round
+template <int PHASE, int ORDER>
+void updateTrial()
+{
+	if(ORDER == 1){
+		
+		if(!ProbePhase){
+			ProbePhase = cue<PHASE,ORDER>();
+		}else if(ProbePhase  && elapsed > lastFrameCue + Probe2CueDelay){
+		probe<ORDER>();
+		}
+		
+	} else if(ORDER == 2){
+		probe<ORDER>();
+		if (ProbeBallEdge && elapsed > lastTimeProbe + Probe2CueDelay){
+			ProbePhase = false;
+			cue<PHASE,ORDER>();
+		}
+
+	}
+}
+
+template <int PHASE, int ORDER>
+bool showCue()
+{
+	return (ORDER == 1 && !ProbePhase && !cue<PHASE,ORDER>())||(ORDER == 2 && !ProbePhase && !cue<PHASE,ORDER>() &&(elapsed > lastTimeProbe + Probe2CueDelay));
+}
+
+template <int ORDER>
+bool showProbe()
+{
+	return (ORDER == 2 && ProbePhase && !ProbeBallEdge)|| (ORDER == 1 && ProbePhase && !ProbeBallEdge && (elapsed > lastFrameCue + Probe2CueDelay));
+}
+
+template <int PHASE, int ORDER>
+TrialVariant trialVariantOf()
+{
+	TrialVariant variant = { updateTrial<PHASE,ORDER>, showCue<PHASE,ORDER>, showProbe<ORDER> };
+	return variant;
+}
+
+// Phases other than 1 and 2 run the full trajectory; orders other than 1 and 2 move and show nothing
+TrialVariant selectTrialVariant(int phase, int order)
+{
+	if (order != 1 && order != 2)
+		order = 0;
+	switch (phase)
+	{
+	case 1:
+		return order == 1 ? trialVariantOf<1,1>() : order == 2 ? trialVariantOf<1,2>() : trialVariantOf<1,0>();
+	case 2:
+		return order == 1 ? trialVariantOf<2,1>() : order == 2 ? trialVariantOf<2,2>() : trialVariantOf<2,0>();
+	default:
+		return order == 1 ? trialVariantOf<3,1>() : order == 2 ? trialVariantOf<3,2>() : trialVariantOf<3,0>();
+	}
+}
+
 bool sleep(){
 	for(int i = Probe2CueDelay; i>0; --i){
 				std:: cout<< i<< std::endl;
@@ -1051,22 +1491,7 @@ void online_trial()
 			cueVelSet = true;
 		}
 
-		if(Order == 1){
-			
-			if(!ProbePhase){
-				ProbePhase = cue();
-			}else if(ProbePhase  && elapsed > lastFrameCue + Probe2CueDelay){
-			probe();
-			}
-			
-		} else if(Order == 2){
-			probe();
-			if (ProbeBallEdge && elapsed > lastTimeProbe + Probe2CueDelay){
-				ProbePhase = false;
-				cue();
-			}
-	
-		}
+		trialVariant.update();
 		// Advance frame number
 		frameN++;
 	}
@@ -1080,20 +1505,56 @@ void online_trial()
 
 void updateTheMarkers()
 {
-	optotrak.updateMarkers();
-	markers = optotrak.getAllMarkers();
+	if (acquisition && acquisition->isRunning())
+		acquisition->getMarkers(markers, markersTime);
+	else
+	{
+		tracker->update();
+		markers = tracker->getAllMarkers();
+		markersTime = tracker->getSampleTime();
+	}
+	if (recordingMarkers)
+		markerRecorder.write(markersTime, markers);
 }
 
-void initVariables() 
+bool initVariables() 
 {
-	trial.init(parameters);
+	if (usePsi)
+	{
+		if (!psiTrial.init(parametersFile_directory))
+			return false;
+	}
+	else
+		trial.init(parameters);
 	interoculardistance = str2num<double>(parameters.find("IOD"));
+
+	if (resuming)
+		resumeSession();
+	return true;
+}
+
+// Replays the checkpointed trials: same seed and same answers leave the staircases
+// and the schedule stream exactly where the interrupted session left them
+void resumeSession()
+{
+	for (size_t i = 0; i < checkpoint.responses.size(); i++)
+	{
+		if (usePsi)
+			psiTrial.next(checkpoint.responses[i] != 0);
+		else
+			trial.next(checkpoint.responses[i] != 0);
+	}
+	trialNumber = checkpoint.trials;
+
+	double state = usePsi ? psiTrial.getCurrent().second->getState() : trial.getCurrent().second->getCurrentStaircase()->getState();
+	if (checkpoint.hasNextState && abs(state - checkpoint.nextState) > 1E-6)
+		cerr << "Warning: resumed staircase state " << state << " differs from the checkpoint " << checkpoint.nextState << endl;
 }
 
 void update(int value)
 {
 	glutPostRedisplay();
-	glutTimerFunc(TIMER_MS, update, 0);
+	glutTimerFunc((unsigned int)frameDurationMs, update, 0);
 }
 
 void handleResize(int w, int h)
@@ -1113,9 +1574,9 @@ void initProjectionScreen(double _focalDist, const Affine3d &_transformation, bo
 	screen.transform(_transformation);
 	cam.init(screen);
 	if ( synchronous )
-		moveScreenAbsolute(_focalDist,homeFocalDistance,4500);
+		motors->moveScreenAbsolute(_focalDist,homeFocalDistance,4500);
 	else
-		moveScreenAbsoluteAsynchronous(_focalDist,homeFocalDistance,4500);
+		motors->moveScreenAbsoluteAsynchronous(_focalDist,homeFocalDistance,4500);
 }
 
 void initRendering()
@@ -1157,121 +1618,186 @@ void initRendering()
 	// Clean modelview matrix to start
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
+
+	if (useShaders)
+		shaders.init(LightPosition, LightAmbient, LightDiffuse);
+	gpuProfiler.init();
 }
 
-void initMotors()
+// Chooses real or simulated devices from the command line
+void initHardware(int argc, char *argv[])
 {
-	homeEverything(6000,4000);
+	string markerFile;
+	bool realtime = true;
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--simulate")
+		{
+			simulatedHardware = true;
+			if (i+1 < argc && string(argv[i+1]).compare(0, 2, "--") != 0)
+				markerFile = argv[++i];
+		}
+		else if (arg == "--max-speed")
+			realtime = false;
+		else if (arg == "--record-markers" && i+1 < argc)
+			recordingMarkers = markerRecorder.open(argv[++i]);
+		else if (arg == "--free-run")
+			freeRunning = true;
+		else if (arg == "--fixed-function")
+			useShaders = false;
+		else if (arg == "--latch" && i+1 < argc)
+			latchMs = str2num<double>(argv[++i]);
+		else if (arg == "--realtime")
+		{
+			realtimeProfile.enabled = true;
+			if (i+1 < argc && isdigit(argv[i+1][0]))
+				realtimeProfile.renderCore = str2num<int>(argv[++i]);
+			if (i+1 < argc && isdigit(argv[i+1][0]))
+				realtimeProfile.acquisitionCore = str2num<int>(argv[++i]);
+		}
+	}
+
+	if (simulatedHardware)
+	{
+		tracker = new RecordedTracker(markerFile, OPTO_NUM_MARKERS, realtime);
+		motors = new SimulatedMotors();
+		audio = new SimulatedAudio();
+		return;
+	}
+	tracker = new OptotrakTracker(LastAlignedFile, OPTO_NUM_MARKERS, OPTO_FRAMERATE, OPTO_MARKER_FREQ, OPTO_DUTY_CYCLE, OPTO_VOLTAGE, calibration);
+	motors = new BrownMotors();
+#ifdef _WIN32
+	audio = new WindowsAudio();
+#else
+	audio = new SimulatedAudio();
+#endif
 }
 
-void initOptotrak()
+bool initMotors()
 {
-	optotrak.setTranslation(calibration);
+	motors->homeEverything(6000,4000);
+	return true;
+}
 
-	if ( optotrak.init(LastAlignedFile, OPTO_NUM_MARKERS, OPTO_FRAMERATE, OPTO_MARKER_FREQ, OPTO_DUTY_CYCLE,OPTO_VOLTAGE) != 0)
-	{   cerr << "Something during Optotrak initialization failed, press ENTER to continue. A error log has been generated, look \"opto.err\" in this folder" << endl;
-	cin.ignore(1E6,'\n');
-	exit(0);
+bool initOptotrak()
+{
+	if ( !tracker->init() )
+	{   cerr << "Something during Optotrak initialization failed. A error log has been generated, look \"opto.err\" in this folder" << endl;
+		return false;
 	}
 
+	acquisition = new AcquisitionThread(tracker, head1, head2, head3);
+	if (realtimeProfile.enabled)
+		acquisition->setRealtime(realtimeProfile.acquisitionCore);
+	acquisition->start();
+	while (acquisition->getMarkers(markers, markersTime) == 0)
+		boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+
 	// Read 10 frames of coordinates and fill the markers vector
 	for (int i=0; i<10; i++)
 	{
 		updateTheMarkers();
 	}
+	return true;
+}
+
+// The stereo window (or a plain one for the simulation), the GL state and the refresh rate
+bool initDisplay(int *argc, char *argv[])
+{
+	renderBackend = openDisplay(simulatedHardware, GAME_MODE_STRING, argc, argv, SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (!renderBackend)
+		return false;
+	//glutFullScreen();
+	initRendering();
+	frameDurationMs = detectRefreshPeriod(renderBackend, frameDurationMs);
+	frameScheduler = FrameScheduler(frameDurationMs, latchMs, !freeRunning);
+	return true;
+}
+
+// The response keys are known once the parameters file is loaded
+bool initInput()
+{
+	inputThread = InputThread::launch(&inputQueue, responseKeys);
+	return true;
+}
+
+// Idle callback of the scheduled loop: sleeps to the latch point, then the late latch of
+// input and markers and the redraw
+void scheduledFrame()
+{
+	frameScheduler.waitForLatch();
+	idle();
+	glutPostRedisplay();
 }
 
 void cleanup()
 {
+	if (inputThread)
+		inputThread->stop();
+	if (latencyFile.is_open())
+	{
+		responseTimes.writeSummary(latencyFile, parameters.find("SubjectName"), checkpoint.seed, checkpoint.trials);
+		latencyFile.close();
+	}
 	// Stop the optotrak
-	optotrak.stopCollection();
+	if (acquisition)
+		acquisition->stop();
+	tracker->stop();
+	frameScheduler.writeReport("schedulingJitter.txt", acquisition ? &acquisition->getWakeUpJitter() : NULL);
+	releaseTimerResolution();
 }
 
 void beepOk(int tone)
 {
-#ifndef SIMULATION
-	switch(tone)
-	{
-	case 0:
-		// Remember to put double slash \\ to specify directories!!!
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-1.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 1:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\calibrate.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 2:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 3:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-reject.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 4:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-twoBlips.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 7:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-left.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 8:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-right.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 9:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-home.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 10:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-grasp.wav", 
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 11:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-marker.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 12:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-estimate.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 13:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8_lowpass.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 14:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-8_double.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 15:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-rising.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 16:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-falling.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 17:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-highBubblePop.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 18:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-lowBubblePop.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 19:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\beep-success.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	case 20:
-		PlaySound((LPCSTR) "C:\\cygwin\\home\\visionlab\\workspace\\cncsvision\\data\\beep\\spoken-watch.wav",
-			NULL, SND_FILENAME | SND_ASYNC);
-		break;
-	}
-#endif
-	return;
+	audio->play(tone);
+	responseTimes.feedback(hardwareClock());
+}
+
+/*** Trial variant benchmark ***/
+// Runs every Phase/Order variant for the given number of trials of the given number of
+// frames, without display or devices. Each frame calls update() once and the draw selection
+// once per eye, as online_trial() and drawStimulus() do; the per-frame console output of
+// cue() and probe() is dropped while timing. Results go to trialVariantBenchmark.txt.
+void benchmarkTrialVariants(int trials, int frames)
+{
+	ofstream results("trialVariantBenchmark.txt");
+	results << fixed << setprecision(4) << "Phase\tOrder\ttrials\tframes\tmeanFrameUs\tcueFrames\tprobeFrames" << endl;
+	speed = 6.8;
+	Gravity = 9.81;
+	probeSpeed = 6.8;
+	for (int phase = 1; phase <= 3; phase++)
+		for (int order = 1; order <= 2; order++)
+		{
+			Phase = phase;
+			Order = order;
+			int cueFrames = 0, probeFrames = 0;
+			streambuf *console = cout.rdbuf(NULL);
+			double start = hardwareClock();
+			for (trialNumber = 0; trialNumber < trials; trialNumber++)
+			{
+				probeDistance = 175;
+				startTrialMotion();
+				for (frameN = 0; frameN < frames; frameN++)
+				{
+					elapsed = frameN*frameDurationMs;
+					trialVariant.update();
+					for (int eye = 0; eye < 2; eye++)
+					{
+						cueFrames += trialVariant.showCue();
+						probeFrames += trialVariant.showProbe();
+					}
+				}
+			}
+			double totalMs = hardwareClock() - start;
+			cout.rdbuf(console);
+			cout.clear();
+
+			results << Phase << "\t" << Order << "\t" << trials << "\t" << frames << "\t" <<
+				1000*totalMs/(trials*frames) << "\t" << cueFrames << "\t" << probeFrames << endl;
+			cout << fixed << setprecision(3) << "Phase " << Phase << ", Order " << Order << ": " <<
+				1000*totalMs/(trials*frames) << " us per frame" << endl;
+		}
 }
 
 ///////////////////////////////////////////////////////////
@@ -1280,34 +1806,58 @@ void beepOk(int tone)
 
 int main(int argc, char*argv[])
 {
-	mathcommon::randomizeStart();
-
-	// Initializes the optotrak and starts the collection of points in background
-	initMotors();
-	initOptotrak();
-
-	glutInit(&argc, argv);
-	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_STEREO);
-	glutGameModeString(GAME_MODE_STRING);
-	glutEnterGameMode();
-	//glutFullScreen();
-
-	initRendering();
-	initStreams(); // parameters file is loaded
+	// Trial logic timing: "--trial-bench [trials] [frames]", no display or devices
+	if (argc > 1 && string(argv[1]) == "--trial-bench")
+	{
+		benchmarkTrialVariants(argc > 2 ? str2num<int>(argv[2]) : 1000, argc > 3 ? str2num<int>(argv[3]) : 600);
+		return 0;
+	}
 
-	initVariables(); // staircases are built
+	// the random seed is chosen (or restored) in initStreams()
+	initHardware(argc, argv);
+	if (!initSubject())
+		return 0;
+
+	// Devices, display and parameters start together: the display stays on this thread,
+	// which owns the GL context, the other steps run on workers (see startupTimeline.txt)
+	StartupSequence startup;
+	startup.add("motors", initMotors);
+	startup.add("tracker", initOptotrak);
+	startup.add("display", boost::bind(initDisplay, &argc, argv), true);
+	int streams = startup.add("parameters", initStreams);
+	startup.after(startup.add("input", initInput), streams);
+	startup.after(startup.add("variables", initVariables), streams); // staircases are built
+	bool started = startup.run();
+	startup.writeTimeline("startupTimeline.txt");
+	if (!started)
+	{
+		// every worker has returned, so the program can stop here
+		cerr << "Startup failed, press ENTER to exit" << endl;
+		cin.ignore(1E6,'\n');
+		if (inputThread)
+			inputThread->stop();
+		if (acquisition)
+			acquisition->stop();
+		releaseTimerResolution();
+		delete renderBackend;
+		return 1;
+	}
+	applyRenderThreadProfile(realtimeProfile);
 	glutDisplayFunc(drawGLScene);
-	glutKeyboardFunc(handleKeypress);
+	glutKeyboardFunc(keyboardEvent);
 	glutReshapeFunc(handleResize);
-	glutIdleFunc(idle);
-	glutTimerFunc(TIMER_MS, update, 0);
+	if (freeRunning)
+	{
+		glutIdleFunc(idle);
+		glutTimerFunc((unsigned int)frameDurationMs, update, 0);
+	}
+	else
+		glutIdleFunc(scheduledFrame);
 	glutSetCursor(GLUT_CURSOR_NONE);
 
-	//boost::thread initVariablesThread(&initVariables);
-
 	glutMainLoop();
 
-	homeEverything(6000,4000);
+	motors->homeEverything(6000,4000);
 	cleanup();
 	return 0;
 }
@@ -0,0 +1,369 @@
+// This file is part of CNCSVision, a computer vision related library
+// This software is developed under the grant of Italian Institute of Technology
+//
+// Copyright (C) 2011 Carlo Nicolini <carlo.nicolini@iit.it>
+//
+// CNCSVision is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+//
+// Alternatively, you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of
+// the License, or (at your option) any later version.
+//
+// CNCSVision is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License or the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License and a copy of the GNU General Public License along with
+// CNCSVision. If not, see <http://www.gnu.org/licenses/>.
+
+// Monte Carlo harness for the EXP2 staircases.
+// Runs the same TrialGenerator/ParStaircase (or PsiTrialGenerator with "Procedure: psi")
+// that fall18-abdul-GravityEXP2 builds from its parameters file against a SimulatedObserver,
+// many times in parallel, and reports for each condition how many trials the staircase
+// needed before terminating and how far its threshold estimate lands from the simulated PSE.
+//
+// Usage:
+//   GravityStaircaseSim [parametersFile] [runs] [pse] [slope] [lapse] [threads] [seed]
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+/********* BOOST MULTITHREADED LIBRARY ****************/
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+/********* INCLUDE CNCSVISION LIBRARY HEADERS **********/
+#include "Mathcommon.h"
+#include "ParametersLoader.h"
+#include "ParStaircase.h"
+#include "Staircase.h"
+#include "TrialGenerator.h"
+#include "Util.h"
+
+#include "GravityParameters.h"
+#include "GravityRandom.h"
+#include "PsiStaircase.h"
+#include "SimulatedObserver.h"
+
+/********* NAMESPACE DIRECTIVES ************************/
+using namespace std;
+using namespace mathcommon;
+using namespace util;
+
+/********* SIMULATION SETTINGS *************************/
+string parametersFile_directory = "fall18-GravityEXP2Parameters.txt";
+string resultsFile_directory = "staircaseSimulation.txt";
+int numRuns = 1000;
+int numThreads = 0; // 0 means one per hardware thread
+unsigned int baseSeed = 1;
+SimulatedObserver observer(10.0, 1.0, 0.02);
+
+// Upper bound on the number of trials of a single simulated session, protects against
+// a staircase configuration that never terminates
+const int maxSessionTrials = 100000;
+
+/********* RESULTS *************************************/
+// What a single staircase did during one simulated session
+struct ConditionRun
+{
+	int trials;
+	int reversals;
+	double estimate;
+	double lastLevel;
+	int lastDirection;
+	vector<double> reversalLevels;
+
+	ConditionRun() : trials(0), reversals(0), estimate(0), lastLevel(0), lastDirection(0) {}
+};
+
+typedef map<string, ConditionRun> SessionRun;
+
+vector<SessionRun> runResults;
+vector<int> runTrials;
+ParametersLoader parameters;
+int maxTrialsPerStaircase = 0;
+bool usePsi = false;
+
+boost::mutex runMutex;
+int nextRun = 0;
+// TrialGenerator shuffles with the process-wide rand(): every call that may shuffle holds
+// this lock and reseeds rand() from the run's own schedule stream first, so a run gets the
+// same schedule whatever the other threads do
+boost::mutex randMutex;
+
+/********** FUNCTION PROTOTYPES *****/
+string conditionName(const map<string,double> &factors);
+void recordTrial(ConditionRun &condition, double level);
+void finalizeCondition(ConditionRun &condition);
+void simulateRun(int run);
+void simulatePsiRun(int run);
+void worker();
+void printSummary(double elapsedSeconds);
+
+/*************************** FUNCTIONS ***********************************/
+// Builds a readable key such as "Gravity=9.81 Order=1" from the factor levels of a trial
+string conditionName(const map<string,double> &factors)
+{
+	ostringstream name;
+	for (map<string,double>::const_iterator iter = factors.begin(); iter != factors.end(); ++iter)
+	{
+		if (iter != factors.begin())
+			name << " ";
+		name << iter->first << "=" << iter->second;
+	}
+	return name.str();
+}
+
+// Counts a trial and detects reversals of the staircase direction
+void recordTrial(ConditionRun &condition, double level)
+{
+	if (condition.trials > 0 && level != condition.lastLevel)
+	{
+		int direction = (level > condition.lastLevel) ? 1 : -1;
+		if (condition.lastDirection != 0 && direction != condition.lastDirection)
+		{
+			condition.reversals++;
+			condition.reversalLevels.push_back(condition.lastLevel);
+		}
+		condition.lastDirection = direction;
+	}
+	condition.lastLevel = level;
+	condition.trials++;
+}
+
+// Threshold estimate: mean of the second half of the reversal levels, as usually done
+// for up/down staircases. Falls back to the last level if the staircase never reversed.
+void finalizeCondition(ConditionRun &condition)
+{
+	int n = (int)condition.reversalLevels.size();
+	if (n == 0)
+	{
+		condition.estimate = condition.lastLevel;
+		return;
+	}
+	double sum = 0;
+	int first = n/2;
+	for (int i = first; i < n; i++)
+		sum += condition.reversalLevels[i];
+	condition.estimate = sum/(n-first);
+}
+
+// One complete simulated session, following the same loop as initTrial()/advanceTrial()
+void simulateRun(int run)
+{
+	RandomStream observerStream(baseSeed + run, RNG_OBSERVER);
+	RandomStream scheduleStream(baseSeed + run, RNG_SCHEDULE);
+
+	TrialGenerator<double> trial;
+	{
+		boost::mutex::scoped_lock lock(randMutex);
+		srand((unsigned int)scheduleStream.next());
+		trial.init(parameters);
+	}
+
+	SessionRun session;
+	int trials = 0;
+	while (trials < maxSessionTrials)
+	{
+		map<string,double> factors = trial.getCurrent().first;
+		double probeSpeed = trial.getCurrent().second->getCurrentStaircase()->getState();
+
+		recordTrial(session[conditionName(factors)], probeSpeed);
+		bool response = observer.respond(probeSpeed, observerStream);
+		trials++;
+
+		if (trial.isEmpty())
+			break;
+		boost::mutex::scoped_lock lock(randMutex);
+		srand((unsigned int)scheduleStream.next());
+		trial.next(response);
+	}
+
+	for (SessionRun::iterator iter = session.begin(); iter != session.end(); ++iter)
+		finalizeCondition(iter->second);
+
+	runResults[run] = session;
+	runTrials[run] = trials;
+}
+
+// Same as simulateRun() for the psi procedure, the estimate is the posterior mean threshold
+void simulatePsiRun(int run)
+{
+	RandomStream observerStream(baseSeed + run, RNG_OBSERVER);
+	RandomStream scheduleStream(baseSeed + run, RNG_SCHEDULE);
+
+	PsiTrialGenerator trial;
+	trial.setRandomStream(&scheduleStream);
+	trial.init(parametersFile_directory);
+
+	SessionRun session;
+	int trials = 0;
+	while (trials < maxSessionTrials && !trial.isEmpty())
+	{
+		map<string,double> factors = trial.getCurrent().first;
+		double probeSpeed = trial.getCurrent().second->getState();
+
+		recordTrial(session[conditionName(factors)], probeSpeed);
+		bool response = observer.respond(probeSpeed, observerStream);
+		trials++;
+		trial.next(response);
+	}
+
+	for (size_t c = 0; c < trial.size(); c++)
+	{
+		ConditionRun &condition = session[conditionName(trial.getCondition(c))];
+		finalizeCondition(condition);
+		condition.estimate = trial.getStaircase(c).getThreshold();
+	}
+
+	runResults[run] = session;
+	runTrials[run] = trials;
+}
+
+// Takes runs from the shared counter until all of them are done.
+// Every run owns its generator and random streams, so runs only share the counter
+// (and rand(), which TrialGenerator uses internally, see randMutex).
+void worker()
+{
+	while (true)
+	{
+		int run;
+		{
+			boost::mutex::scoped_lock lock(runMutex);
+			if (nextRun >= numRuns)
+				return;
+			run = nextRun++;
+		}
+		if (usePsi)
+			simulatePsiRun(run);
+		else
+			simulateRun(run);
+	}
+}
+
+void printSummary(double elapsedSeconds)
+{
+	map<string, vector<ConditionRun> > byCondition;
+	for (int run = 0; run < numRuns; run++)
+		for (SessionRun::const_iterator iter = runResults[run].begin(); iter != runResults[run].end(); ++iter)
+			byCondition[iter->first].push_back(iter->second);
+
+	ofstream resultsFile(resultsFile_directory.c_str());
+	string resultsFile_headers = "condition\truns\tpse\tslope\tlapse\tmeanTrials\tsdTrials\tmaxTrials\tcapHits\tmeanReversals\tmeanEstimate\tbias\tsdEstimate\trmse";
+	resultsFile << fixed << resultsFile_headers << endl;
+	cout << fixed << setprecision(3);
+	cout << resultsFile_headers << endl;
+
+	for (map<string, vector<ConditionRun> >::const_iterator iter = byCondition.begin(); iter != byCondition.end(); ++iter)
+	{
+		const vector<ConditionRun> &runs = iter->second;
+		int n = (int)runs.size();
+		double sumTrials = 0, sumTrials2 = 0, sumReversals = 0, sumEstimate = 0, sumEstimate2 = 0, sumError2 = 0;
+		int maxTrials = 0, capHits = 0;
+		for (int i = 0; i < n; i++)
+		{
+			sumTrials += runs[i].trials;
+			sumTrials2 += (double)runs[i].trials*runs[i].trials;
+			sumReversals += runs[i].reversals;
+			sumEstimate += runs[i].estimate;
+			sumEstimate2 += runs[i].estimate*runs[i].estimate;
+			sumError2 += pow(runs[i].estimate - observer.pse, 2);
+			maxTrials = max(maxTrials, runs[i].trials);
+			if (maxTrialsPerStaircase > 0 && runs[i].trials >= maxTrialsPerStaircase)
+				capHits++;
+		}
+		double meanTrials = sumTrials/n;
+		double meanEstimate = sumEstimate/n;
+
+		ostringstream row;
+		row << fixed << setprecision(3) <<
+			iter->first << "\t" <<
+			n << "\t" <<
+			observer.pse << "\t" <<
+			observer.slope << "\t" <<
+			observer.lapse << "\t" <<
+			meanTrials << "\t" <<
+			sqrt(max(0.0, sumTrials2/n - meanTrials*meanTrials)) << "\t" <<
+			maxTrials << "\t" <<
+			capHits << "\t" <<
+			sumReversals/n << "\t" <<
+			meanEstimate << "\t" <<
+			meanEstimate - observer.pse << "\t" <<
+			sqrt(max(0.0, sumEstimate2/n - meanEstimate*meanEstimate)) << "\t" <<
+			sqrt(sumError2/n);
+		resultsFile << row.str() << endl;
+		cout << row.str() << endl;
+	}
+
+	double sessionTrials = 0;
+	for (int run = 0; run < numRuns; run++)
+		sessionTrials += runTrials[run];
+	cout << "# Mean trials per session: " << sessionTrials/numRuns << endl;
+	cout << "# " << numRuns << " runs on " << numThreads << " threads in " << elapsedSeconds << " s" << endl;
+}
+
+///////////////////////////////////////////////////////////
+////////////////////// MAIN FUNCTION //////////////////////
+///////////////////////////////////////////////////////////
+
+int main(int argc, char*argv[])
+{
+	if (argc > 1) parametersFile_directory = argv[1];
+	if (argc > 2) numRuns = str2num<int>(argv[2]);
+	if (argc > 3) observer.pse = str2num<double>(argv[3]);
+	if (argc > 4) observer.slope = str2num<double>(argv[4]);
+	if (argc > 5) observer.lapse = str2num<double>(argv[5]);
+	if (argc > 6) numThreads = str2num<int>(argv[6]);
+	if (argc > 7) baseSeed = str2num<unsigned int>(argv[7]);
+
+	ifstream parametersFile;
+	parametersFile.open(parametersFile_directory.c_str());
+	if (!parametersFile.is_open())
+	{
+		cerr << parametersFile_directory << " not found" << endl;
+		return 1;
+	}
+	parameters.loadParameterFile(parametersFile);
+	map<string,string> optionalParameters = readParameterLines(parametersFile_directory);
+	usePsi = findParameter(optionalParameters, "Procedure", "staircase") == "psi";
+	if (usePsi)
+		maxTrialsPerStaircase = findParameter<int>(optionalParameters, "sPsiMaxTrials", 40);
+	else
+		maxTrialsPerStaircase = str2num<int>(parameters.find("sStairMaxTrials"));
+
+	if (numThreads <= 0)
+		numThreads = max(1, (int)boost::thread::hardware_concurrency());
+
+	// the runs build their generators from the same file, check it once
+	PsiTrialGenerator psiCheck;
+	if (usePsi && !psiCheck.init(parametersFile_directory))
+		return 1;
+
+	runResults.resize(numRuns);
+	runTrials.resize(numRuns);
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::local_time();
+	boost::thread_group workers;
+	for (int i = 0; i < numThreads; i++)
+		workers.create_thread(&worker);
+	workers.join_all();
+	boost::posix_time::time_duration duration = boost::posix_time::microsec_clock::local_time() - start;
+
+	printSummary(duration.total_microseconds()/1E6);
+	return 0;
+}